@@ -0,0 +1,130 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Default number of random reads per run */
+#define DEFAULT_READ_COUNT 1000000
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n <read count>] <diskname> <filename>\n",
+		program);
+	fprintf(stderr, "\t-n\tnumber of random block reads per run (default: "
+		"%d)\n", DEFAULT_READ_COUNT);
+	fprintf(stderr, "Read random blocks of a file from the virtual disk "
+		"file, then from a RAM disk with\nregular pages, then from a "
+		"RAM disk with huge pages\n");
+	exit(1);
+}
+
+size_t get_argv(char *argv)
+{
+	char *end;
+	long int ret = strtol(argv, &end, 0);
+	if (*end != '\0' || ret < 0 || ret == LONG_MAX)
+		return 0;
+	return (size_t)ret;
+}
+
+/* Time @count reads of random blocks of @filename, mounted with @options */
+void run(const char *name, const char *diskname, const char *filename,
+	 const struct fs_mount_options *options, size_t count)
+{
+	static char buf[BLOCK_SIZE];
+	struct timespec start, end;
+	uint64_t state = 88172645463325252ULL;
+	size_t num_blks;
+	double secs;
+	int fd;
+
+	if (fs_mount_with(diskname, options))
+		die("Cannot mount diskname");
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	num_blks = fs_stat(fd) / BLOCK_SIZE;
+	if (!num_blks) {
+		fs_umount();
+		die("File '%s' is smaller than a block", filename);
+	}
+
+	/* The first pass brings the file in, the second one is timed */
+	for (int pass = 0; pass < 2; pass++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < count; i++) {
+			/* xorshift64: cheap enough not to weigh on the reads */
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			fs_pread(fd, buf, BLOCK_SIZE,
+				 (state % num_blks) * BLOCK_SIZE);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	}
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-24s %10.0f reads/s %8.1f MiB/s\n", name, count / secs,
+	       count * (double)BLOCK_SIZE / secs / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_mount_options options = { 0 };
+	char *program, *diskname, *filename;
+	size_t count = DEFAULT_READ_COUNT;
+	int opt;
+
+	program = argv[0];
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = get_argv(optarg);
+			if (!count)
+				die("read count invalid");
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(program);
+
+	diskname = argv[optind];
+	filename = argv[optind + 1];
+
+	options.regular_pages = 1;
+	run("disk file", diskname, filename, &options, count);
+
+	options.ram_disk = 1;
+	run("RAM disk, regular pages", diskname, filename, &options, count);
+
+	options.regular_pages = 0;
+	run("RAM disk, huge pages", diskname, filename, &options, count);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_build_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_build_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n <data block count>] <diskname> "
+		"<host directory | host file...>\n", program);
+	fprintf(stderr, "\t-n\tsize of the virtual disk if it must be created "
+		"(default: just enough for the files)\n");
+	exit(1);
+}
+
+size_t get_argv(char *argv)
+{
+	char *end;
+	long int ret = strtol(argv, &end, 0);
+	if (*end != '\0' || ret < 0 || ret == LONG_MAX)
+		return 0;
+	return (size_t)ret;
+}
+
+static int is_regular(const struct dirent *entry)
+{
+	return entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN;
+}
+
+/* List the regular files of host directory @dirname, sorted by name */
+int list_directory(char *dirname, char **paths)
+{
+	struct dirent **entries;
+	struct stat st;
+	int count, num_files = 0;
+
+	count = scandir(dirname, &entries, is_regular, alphasort);
+	if (count < 0)
+		die_perror("scandir");
+
+	for (int i = 0; i < count; i++) {
+		char *path = malloc(strlen(dirname) + strlen(entries[i]->d_name) + 2);
+
+		if (!path)
+			die_perror("malloc");
+		sprintf(path, "%s/%s", dirname, entries[i]->d_name);
+		free(entries[i]);
+
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (num_files == FS_FILE_MAX_COUNT)
+			die("More than %d files in '%s'", FS_FILE_MAX_COUNT,
+			    dirname);
+		paths[num_files++] = path;
+	}
+	free(entries);
+
+	return num_files;
+}
+
+int main(int argc, char **argv)
+{
+	char *paths[FS_FILE_MAX_COUNT];
+	char *program, *diskname;
+	size_t data_blk_count = 0;
+	struct stat st;
+	int num_files = 0;
+	int opt;
+
+	program = argv[0];
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			data_blk_count = get_argv(optarg);
+			if (data_blk_count < 1
+			    || data_blk_count > FS_DATA_BLK_MAX_COUNT)
+				die("data block count invalid, range is [1, %d]",
+				    FS_DATA_BLK_MAX_COUNT);
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (argc - optind < 2)
+		usage(program);
+
+	diskname = argv[optind];
+
+	if (argc - optind == 2 && !stat(argv[optind + 1], &st)
+	    && S_ISDIR(st.st_mode)) {
+		num_files = list_directory(argv[optind + 1], paths);
+	} else {
+		if (argc - optind - 1 > FS_FILE_MAX_COUNT)
+			die("More than %d files", FS_FILE_MAX_COUNT);
+		for (int i = optind + 1; i < argc; i++)
+			paths[num_files++] = argv[i];
+	}
+
+	/* Size a new disk after its content, plus the reserved first block */
+	if (access(diskname, F_OK)) {
+		if (!data_blk_count) {
+			data_blk_count = 1;
+			for (int i = 0; i < num_files; i++) {
+				if (stat(paths[i], &st))
+					die_perror("stat");
+				data_blk_count += (st.st_size + BLOCK_SIZE - 1)
+					/ BLOCK_SIZE;
+			}
+		}
+		if (data_blk_count > FS_DATA_BLK_MAX_COUNT)
+			die("Files do not fit in a virtual disk");
+		if (fs_format(diskname, data_blk_count, NULL))
+			die("Cannot create virtual disk '%s'", diskname);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_import((const char *const *)paths, num_files) != num_files) {
+		fs_umount();
+		die("Cannot import files into '%s'", diskname);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d files into '%s'\n", num_files, diskname);
+
+	return 0;
+}
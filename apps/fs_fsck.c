@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_fsck_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_fsck_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] <diskname>\n", program);
+	fprintf(stderr, "\t-r\trepair the problems found\n");
+	fprintf(stderr, "Exit status is 0 if the file system is consistent, 1 if "
+		"problems were found, 2 if it cannot be checked\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char *program, *diskname;
+	int repair = 0;
+	int num_problems;
+	int opt;
+
+	program = argv[0];
+
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (argc - optind != 1)
+		usage(program);
+
+	diskname = argv[optind];
+
+	num_problems = fs_check(diskname, repair);
+	if (num_problems < 0)
+		die("Cannot check virtual disk '%s'", diskname);
+
+	if (!num_problems) {
+		printf("'%s' is consistent\n", diskname);
+		return 0;
+	}
+
+	printf("'%s': %d problem(s) %s\n", diskname, num_problems,
+	       repair ? "repaired" : "found");
+
+	return 1;
+}
@@ -0,0 +1,82 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-l] [-p] [-r <reserved FAT blocks>] "
+		"<diskname> <data block count>\n", program);
+	fprintf(stderr, "\t-l\twrite data blocks sequentially, at the head of "
+		"a log\n");
+	fprintf(stderr, "\t-p\tallocate disk space up front instead of "
+		"creating a sparse file\n");
+	fprintf(stderr, "\t-r\treserve FAT blocks for growing the volume "
+		"later\n");
+	exit(1);
+}
+
+size_t get_argv(char *argv)
+{
+	char *end;
+	long int ret = strtol(argv, &end, 0);
+	if (*end != '\0' || ret < 0 || ret == LONG_MAX)
+		return 0;
+	return (size_t)ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_options options = { 0 };
+	char *program, *diskname;
+	size_t data_blk_count;
+	int opt;
+
+	program = argv[0];
+
+	while ((opt = getopt(argc, argv, "lpr:")) != -1) {
+		switch (opt) {
+		case 'l':
+			options.log_structured = 1;
+			break;
+		case 'p':
+			options.preallocate = 1;
+			break;
+		case 'r':
+			options.fat_reserve_blks = get_argv(optarg);
+			break;
+		default:
+			usage(program);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(program);
+
+	diskname = argv[optind];
+	data_blk_count = get_argv(argv[optind + 1]);
+
+	if (data_blk_count < 1 || data_blk_count > FS_DATA_BLK_MAX_COUNT)
+		die("data block count invalid, range is [1, %d]",
+		    FS_DATA_BLK_MAX_COUNT);
+
+	if (fs_format(diskname, data_blk_count, &options))
+		die("Cannot create virtual disk '%s'", diskname);
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       data_blk_count);
+
+	return 0;
+}
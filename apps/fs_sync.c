@@ -0,0 +1,425 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_sync_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_sync_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define SIG_LEN 8
+
+/* Manifest: header followed by one 64-bit hash per block */
+#define MANIFEST_SIG "ECS150HM"
+struct __attribute__((__packed__)) manifest_header {
+	uint8_t signature[SIG_LEN];
+	uint32_t num_blks;
+};
+
+/*
+ * Delta: header followed by one (uint32_t index, block content) record per
+ * block. Same layout as the change files of fs_export_changes(), so that
+ * fs_apply_changes() applies both.
+ */
+#define DELTA_SIG "ECS150CB"
+struct __attribute__((__packed__)) delta_header {
+	uint8_t signature[SIG_LEN];
+	uint32_t tot_amt_blks;
+	uint32_t num_blks;
+};
+
+/*
+ * Block hash: independent lanes over interleaved 64-bit words, so that the
+ * inner loop has no dependency between lanes and vectorizes.
+ */
+#define HASH_LANES 8
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t block_hash(const uint8_t *blk)
+{
+	uint64_t acc[HASH_LANES];
+	uint64_t w[HASH_LANES];
+	uint64_t h = 0;
+	size_t i, j;
+
+	for (j = 0; j < HASH_LANES; j++)
+		acc[j] = PRIME64_1 * (j + 1);
+
+	for (i = 0; i < BLOCK_SIZE; i += sizeof(w)) {
+		memcpy(w, blk + i, sizeof(w));
+		for (j = 0; j < HASH_LANES; j++)
+			acc[j] = rotl64(acc[j] + w[j] * PRIME64_2, 31) * PRIME64_1;
+	}
+
+	for (j = 0; j < HASH_LANES; j++)
+		h = rotl64(h ^ acc[j], 27) * PRIME64_1 + PRIME64_2;
+
+	return h ^ (h >> 29);
+}
+
+/* Disk image, or manifest of one */
+struct image {
+	/* Content of the blocks, NULL for a manifest */
+	const uint8_t *data;
+	/* Hash of each block, NULL for an image */
+	const uint64_t *hashes;
+	size_t num_blks;
+};
+
+static struct image map_image(const char *filename)
+{
+	struct image img = { 0 };
+	const struct manifest_header *hdr;
+	struct stat st;
+	uint8_t *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (st.st_size == 0)
+		die("Empty file: %s", filename);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	hdr = (const struct manifest_header *)map;
+	if ((size_t)st.st_size >= sizeof(*hdr)
+	    && !memcmp(hdr->signature, MANIFEST_SIG, SIG_LEN)) {
+		img.num_blks = hdr->num_blks;
+		if (sizeof(*hdr) + img.num_blks * sizeof(uint64_t)
+		    != (size_t)st.st_size)
+			die("Truncated manifest: %s", filename);
+		img.hashes = (const uint64_t *)(map + sizeof(*hdr));
+	} else {
+		if (st.st_size % BLOCK_SIZE)
+			die("Not a disk image: %s", filename);
+		img.num_blks = st.st_size / BLOCK_SIZE;
+		img.data = map;
+	}
+
+	return img;
+}
+
+/* Share of the blocks handled by one thread */
+struct worker {
+	const struct image *old;
+	const struct image *new;
+	/* Output: hash of each block of @new */
+	uint64_t *hashes;
+	/* Output: whether each block differs between @old and @new */
+	uint8_t *differs;
+	size_t first;
+	size_t last;
+};
+
+static void *hash_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	for (size_t b = w->first; b < w->last; b++)
+		w->hashes[b] = block_hash(w->new->data + b * BLOCK_SIZE);
+
+	return NULL;
+}
+
+static void *diff_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	for (size_t b = w->first; b < w->last; b++) {
+		const uint8_t *blk = w->new->data + b * BLOCK_SIZE;
+
+		/* Two images are compared directly, hashing would only cost more */
+		if (w->old->data)
+			w->differs[b] = memcmp(w->old->data + b * BLOCK_SIZE, blk,
+					       BLOCK_SIZE) != 0;
+		else
+			w->differs[b] = w->old->hashes[b] != block_hash(blk);
+	}
+
+	return NULL;
+}
+
+/* Split the blocks of @tmpl->new evenly between one thread per CPU */
+static void run_parallel(void *(*fn)(void *), const struct worker *tmpl)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t num_blks = tmpl->new->num_blks;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > num_blks)
+		nthreads = num_blks ? num_blks : 1;
+
+	pthread_t tids[nthreads];
+	struct worker workers[nthreads];
+
+	for (long i = 0; i < nthreads; i++) {
+		workers[i] = *tmpl;
+		workers[i].first = num_blks * i / nthreads;
+		workers[i].last = num_blks * (i + 1) / nthreads;
+		if (pthread_create(&tids[i], NULL, fn, &workers[i]))
+			die("Cannot create thread");
+	}
+
+	for (long i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+}
+
+struct thread_arg {
+	int argc;
+	char **argv;
+};
+
+void sync_manifest(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct manifest_header hdr;
+	struct image img;
+	struct worker w = { 0 };
+	FILE *out;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <manifest filename>");
+
+	img = map_image(t_arg->argv[0]);
+	if (!img.data)
+		die("Not a disk image: %s", t_arg->argv[0]);
+
+	w.new = &img;
+	w.hashes = malloc(img.num_blks * sizeof(uint64_t));
+	if (!w.hashes)
+		die_perror("malloc");
+	run_parallel(hash_worker, &w);
+
+	memcpy(hdr.signature, MANIFEST_SIG, SIG_LEN);
+	hdr.num_blks = img.num_blks;
+
+	out = fopen(t_arg->argv[1], "w");
+	if (!out)
+		die_perror("fopen");
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+	    || fwrite(w.hashes, sizeof(uint64_t), img.num_blks, out)
+	    != img.num_blks || fclose(out))
+		die_perror("fwrite");
+
+	printf("Wrote manifest of %zu blocks to '%s'\n", img.num_blks,
+	       t_arg->argv[1]);
+	free(w.hashes);
+}
+
+/* Tell which files the differing blocks of @diskname belong to */
+static void report_files(const char *diskname, const uint8_t *differs,
+			 size_t num_blks)
+{
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	size_t counts[FS_FILE_MAX_COUNT] = { 0 };
+	int order[FS_FILE_MAX_COUNT];
+	size_t metadata = 0, unused = 0;
+	int num_files = 0;
+	int *owners;
+
+	if (fs_mount_ro(diskname)) {
+		printf("No file system found, skipping per-file report\n");
+		return;
+	}
+
+	/* Map every block to its file up front, walking each chain once */
+	owners = malloc(num_blks * sizeof(int));
+	if (!owners)
+		die_perror("malloc");
+	if (fs_block_owners(owners, num_blks, names))
+		die("Cannot map blocks to files");
+
+	fs_umount();
+
+	/* Files are listed in the order their first differing block comes in */
+	for (size_t b = 0; b < num_blks; b++) {
+		int x = owners[b];
+
+		if (!differs[b])
+			continue;
+
+		if (x == FS_OWNER_METADATA) {
+			metadata++;
+		} else if (x == FS_OWNER_NONE) {
+			unused++;
+		} else {
+			if (!counts[x])
+				order[num_files++] = x;
+			counts[x]++;
+		}
+	}
+
+	free(owners);
+
+	printf("metadata: %zu\n", metadata);
+	for (int i = 0; i < num_files; i++)
+		printf("file: %s, changed_blks: %zu\n", names[order[i]],
+		       counts[order[i]]);
+	printf("unused: %zu\n", unused);
+}
+
+void sync_diff(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct image old, new;
+	struct worker w = { 0 };
+	size_t num_differs = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <old diskname or manifest> <new diskname> [<delta filename>]");
+
+	old = map_image(t_arg->argv[0]);
+	new = map_image(t_arg->argv[1]);
+	if (!new.data)
+		die("Not a disk image: %s", t_arg->argv[1]);
+	if (old.num_blks != new.num_blks)
+		die("Block counts differ (%zu vs %zu)", old.num_blks,
+		    new.num_blks);
+
+	w.old = &old;
+	w.new = &new;
+	w.differs = malloc(new.num_blks);
+	if (!w.differs)
+		die_perror("malloc");
+	run_parallel(diff_worker, &w);
+
+	for (size_t b = 0; b < new.num_blks; b++)
+		num_differs += w.differs[b];
+
+	printf("Changed blocks: %zu/%zu\n", num_differs, new.num_blks);
+	report_files(t_arg->argv[1], w.differs, new.num_blks);
+
+	/* Differing blocks go out in disk order, for sequential writes */
+	if (t_arg->argc >= 3) {
+		struct delta_header hdr;
+		FILE *out;
+
+		memcpy(hdr.signature, DELTA_SIG, SIG_LEN);
+		hdr.tot_amt_blks = new.num_blks;
+		hdr.num_blks = num_differs;
+
+		out = fopen(t_arg->argv[2], "w");
+		if (!out)
+			die_perror("fopen");
+		if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+			die_perror("fwrite");
+		for (uint32_t b = 0; b < new.num_blks; b++) {
+			if (!w.differs[b])
+				continue;
+			if (fwrite(&b, sizeof(b), 1, out) != 1
+			    || fwrite(new.data + (size_t)b * BLOCK_SIZE,
+				      BLOCK_SIZE, 1, out) != 1)
+				die_perror("fwrite");
+		}
+		if (fclose(out))
+			die_perror("fclose");
+
+		printf("Wrote delta of %zu blocks to '%s'\n", num_differs,
+		       t_arg->argv[2]);
+	}
+
+	free(w.differs);
+}
+
+void sync_apply(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <delta filename>");
+
+	count = fs_apply_changes(t_arg->argv[0], t_arg->argv[1]);
+	if (count < 0)
+		die("Cannot apply delta");
+
+	printf("Applied %d blocks from '%s'\n", count, t_arg->argv[1]);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "manifest",	sync_manifest },
+	{ "diff",	sync_diff },
+	{ "apply",	sync_apply }
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct thread_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fs_sync_error("invalid command '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
@@ -282,7 +282,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -329,7 +329,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -471,7 +471,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +490,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,6 +499,271 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created snapshot '%s'\n", name);
+}
+
+void thread_fs_snapshot_rm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed snapshot '%s'\n", name);
+}
+
+void thread_fs_snapshot_ls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount_snapshot(diskname, name))
+		die("Cannot mount snapshot");
+
+	fs_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_checkpoint(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <checkpoint name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_checkpoint(name)) {
+		fs_umount();
+		die("Cannot set checkpoint");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Set checkpoint '%s'\n", name);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name, *filename;
+	int count;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <checkpoint name> <host filename>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+	filename = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_export_changes(name, filename);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot export changes");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Exported %d blocks changed since '%s' to '%s'\n", count, name,
+		   filename);
+}
+
+void thread_fs_apply(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	count = fs_apply_changes(diskname, filename);
+	if (count < 0)
+		die("Cannot apply changes");
+
+	printf("Applied %d blocks from '%s'\n", count, filename);
+}
+
+void thread_fs_extract(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+	char **filenames = NULL;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	/* Extract every file unless told which ones */
+	if (t_arg->argc > 2)
+		filenames = &t_arg->argv[2];
+
+	if (fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_extract(dirname, (const char *const *)filenames,
+			   t_arg->argc - 2);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot extract files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Extracted %d files to '%s'\n", count, dirname);
+}
+
+void thread_fs_compact(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	count = fs_compact(diskname);
+	if (count < 0)
+		die("Cannot compact diskname");
+
+	printf("Compacted '%s', %d blocks smaller\n", diskname, count);
+}
+
+void thread_fs_clean(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_clean();
+	if (count < 0) {
+		fs_umount();
+		die("Cannot clean diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cleaned '%s', %d segments reclaimed\n", diskname, count);
+}
+
+void thread_fs_pack(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *packname;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <packname>");
+
+	diskname = t_arg->argv[0];
+	packname = t_arg->argv[1];
+
+	count = fs_pack(diskname, packname);
+	if (count < 0)
+		die("Cannot pack diskname");
+
+	printf("Packed '%s' into '%s', %d blocks\n", diskname, packname, count);
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_dedup();
+	if (count < 0) {
+		fs_umount();
+		die("Cannot deduplicate files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deduplicated '%s', %d blocks freed\n", diskname, count);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -507,6 +772,172 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_grow(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <total block count>");
+
+	diskname = t_arg->argv[0];
+	count = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_grow(count)) {
+		fs_umount();
+		die("Cannot grow diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Grew '%s' to %zu blocks\n", diskname, count);
+}
+
+void thread_fs_ring(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	size_t capacity;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <capacity>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	capacity = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create_ring(filename, capacity)) {
+		fs_umount();
+		die("Cannot create ring file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created ring file '%s' (%zu bytes)\n", filename, capacity);
+}
+
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fd, fs_fd;
+	struct stat st;
+	int written;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <host filename> <filename>");
+
+	diskname = t_arg->argv[0];
+
+	/* Open file on host computer */
+	fd = open(t_arg->argv[1], O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", t_arg->argv[1]);
+
+	/* Map file into buffer, unless there is nothing to append */
+	buf = NULL;
+	if (st.st_size > 0) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			die_perror("mmap");
+	}
+
+	filename = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open_append(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	written = buf ? fs_write(fs_fd, buf, st.st_size) : 0;
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Appended to file '%s' (%d/%zu bytes)\n", filename, written,
+		   st.st_size);
+
+	if (buf)
+		munmap(buf, st.st_size);
+	close(fd);
+}
+
+void thread_fs_cachestat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_options options = { 0 };
+	struct fs_cache_stats stats;
+	static char buf[65536];
+	char *diskname, *policy;
+	int fs_fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <lru|2q>[,pin] <filename>...");
+
+	diskname = t_arg->argv[0];
+	policy = strtok(t_arg->argv[1], ",");
+	if (!strcmp(policy, "2q"))
+		options.cache_policy = FS_CACHE_2Q;
+	else if (strcmp(policy, "lru"))
+		die("Unknown cache policy '%s'", policy);
+	policy = strtok(NULL, ",");
+	if (policy && !strcmp(policy, "pin"))
+		options.pin_metadata = 1;
+	else if (policy)
+		die("Unknown cache option '%s'", policy);
+
+	if (fs_mount_with(diskname, &options))
+		die("Cannot mount diskname");
+
+	/* Read every file through, in order */
+	for (int i = 2; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file '%s'", t_arg->argv[i]);
+		}
+		while (fs_read(fs_fd, buf, sizeof(buf)) > 0)
+			;
+		fs_close(fs_fd);
+	}
+
+	if (fs_get_cache_stats(&stats)) {
+		fs_umount();
+		die("Cannot get cache stats");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("policy=%s\n", stats.policy == FS_CACHE_2Q ? "2q" : "lru");
+	printf("hits=%lu\n", stats.hits);
+	printf("misses=%lu\n", stats.misses);
+	printf("evictions=%lu\n", stats.evictions);
+	printf("hit_ratio=%lu/%lu\n", stats.hits, stats.hits + stats.misses);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -517,7 +948,22 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "snapshot_rm",	thread_fs_snapshot_rm },
+	{ "snapshot_ls",	thread_fs_snapshot_ls },
+	{ "checkpoint",	thread_fs_checkpoint },
+	{ "export",	thread_fs_export },
+	{ "apply",	thread_fs_apply },
+	{ "extract",	thread_fs_extract },
+	{ "compact",	thread_fs_compact },
+	{ "grow",	thread_fs_grow },
+	{ "dedup",	thread_fs_dedup },
+	{ "pack",	thread_fs_pack },
+	{ "clean",	thread_fs_clean },
+	{ "ring",	thread_fs_ring },
+	{ "append",	thread_fs_append },
+	{ "cachestat",	thread_fs_cachestat }
 };
 
 void usage(char *program)
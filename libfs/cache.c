@@ -0,0 +1,426 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Marks a slot that does not hold any block */
+#define NO_BLOCK SIZE_MAX
+
+/* 2Q queues: blocks first come in on the FIFO queue */
+#define QUEUE_IN 0
+#define QUEUE_MAIN 1
+
+/* Cache slot description */
+struct slot {
+	/* Index of the cached block, or NO_BLOCK */
+	size_t block;
+	/* Content differs from disk */
+	int dirty;
+	/*
+	 * Logical time of last access, for LRU eviction. Blocks of the 2Q FIFO
+	 * queue keep the time they came in.
+	 */
+	unsigned long last_use;
+	/* 2Q queue the block is on */
+	int queue;
+};
+
+/* Block cache description */
+struct cache {
+	/* Slot descriptors */
+	struct slot *slots;
+	/* Block contents, one BLOCK_SIZE entry per slot */
+	uint8_t *data;
+	/* The block contents may be backed by huge pages */
+	int huge_pages;
+	/* Number of slots that blocks are evicted from */
+	size_t nslots;
+	/*
+	 * Number of slots of the pinned tier, which follow the others. Blocks
+	 * pinned there are never evicted.
+	 */
+	size_t npinned;
+	/* Logical clock */
+	unsigned long clock;
+	/* Eviction policy */
+	int policy;
+	/* 2Q: number of slots on the FIFO queue, and its target size */
+	size_t nin;
+	size_t max_in;
+	/*
+	 * 2Q: indices of the blocks that last left the FIFO queue, in a ring.
+	 * Such a block goes straight to the main queue when used again.
+	 */
+	size_t *ghosts;
+	size_t nghosts;
+	size_t next_ghost;
+	/* Dirty slots sorted by block index, filled in by cache_flush() */
+	struct slot **dirty;
+	/* Counters */
+	struct cache_stats stats;
+};
+
+/* Cache instance (not set up by default) */
+static struct cache cache;
+
+int cache_init(size_t nslots, size_t npinned, int policy, int huge_pages)
+{
+	if (!nslots) {
+		cache_error("invalid slot count");
+		return -1;
+	}
+
+	if (policy != CACHE_POLICY_LRU && policy != CACHE_POLICY_2Q) {
+		cache_error("invalid policy (%d)", policy);
+		return -1;
+	}
+
+	if (cache.slots) {
+		cache_error("cache already set up");
+		return -1;
+	}
+
+	/* Queue sizes suggested by the 2Q paper: a quarter of the slots for
+	 * the FIFO queue, and as many ghosts as half the slots */
+	cache.nghosts = nslots / 2 ? nslots / 2 : 1;
+
+	cache.slots = malloc((nslots + npinned) * sizeof(struct slot));
+	cache.data = block_arena_alloc(nslots + npinned, huge_pages);
+	cache.ghosts = malloc(cache.nghosts * sizeof(size_t));
+	cache.dirty = malloc((nslots + npinned) * sizeof(struct slot *));
+	if (!cache.slots || !cache.data || !cache.ghosts || !cache.dirty) {
+		perror("malloc");
+		free(cache.slots);
+		block_arena_free(cache.data, nslots + npinned, huge_pages);
+		free(cache.ghosts);
+		free(cache.dirty);
+		cache.slots = NULL;
+		cache.data = NULL;
+		cache.ghosts = NULL;
+		cache.dirty = NULL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < nslots + npinned; i++) {
+		cache.slots[i].block = NO_BLOCK;
+		cache.slots[i].dirty = 0;
+		cache.slots[i].last_use = 0;
+		cache.slots[i].queue = QUEUE_IN;
+	}
+	for (size_t i = 0; i < cache.nghosts; i++)
+		cache.ghosts[i] = NO_BLOCK;
+	cache.nslots = nslots;
+	cache.npinned = npinned;
+	cache.huge_pages = huge_pages;
+	cache.clock = 0;
+	cache.policy = policy;
+	cache.nin = 0;
+	cache.max_in = nslots / 4 ? nslots / 4 : 1;
+	cache.next_ghost = 0;
+	memset(&cache.stats, 0, sizeof(cache.stats));
+
+	return 0;
+}
+
+void cache_destroy(void)
+{
+	free(cache.slots);
+	block_arena_free(cache.data, cache.nslots + cache.npinned,
+			 cache.huge_pages);
+	free(cache.ghosts);
+	free(cache.dirty);
+	cache.slots = NULL;
+	cache.data = NULL;
+	cache.ghosts = NULL;
+	cache.dirty = NULL;
+	cache.nslots = 0;
+	cache.npinned = 0;
+}
+
+static struct slot *cache_lookup(size_t block)
+{
+	for (size_t i = 0; i < cache.nslots + cache.npinned; i++)
+		if (cache.slots[i].block == block)
+			return &cache.slots[i];
+
+	return NULL;
+}
+
+static void *slot_data(struct slot *s)
+{
+	return cache.data + (s - cache.slots) * BLOCK_SIZE;
+}
+
+/*
+ * Pick a slot to reuse: a free one, else the LRU clean one, else the LRU one.
+ * Under 2Q, only slots of the queue to evict from are considered: the FIFO
+ * queue while it is over its target size, else the main queue, unless it is
+ * empty.
+ */
+static struct slot *cache_victim(void)
+{
+	struct slot *clean = NULL, *any = NULL;
+	int queue = cache.nin > cache.max_in ? QUEUE_IN : QUEUE_MAIN;
+
+	if (cache.policy == CACHE_POLICY_2Q && queue == QUEUE_MAIN
+	    && cache.nin == cache.nslots)
+		queue = QUEUE_IN;
+
+	for (size_t i = 0; i < cache.nslots; i++) {
+		struct slot *s = &cache.slots[i];
+
+		if (s->block == NO_BLOCK)
+			return s;
+		if (cache.policy == CACHE_POLICY_2Q && s->queue != queue)
+			continue;
+		if (!s->dirty && (!clean || s->last_use < clean->last_use))
+			clean = s;
+		if (!any || s->last_use < any->last_use)
+			any = s;
+	}
+
+	return clean ? clean : any;
+}
+
+/* 2Q: forget that @block left the FIFO queue; return whether it had */
+static int ghost_remove(size_t block)
+{
+	for (size_t i = 0; i < cache.nghosts; i++) {
+		if (cache.ghosts[i] == block) {
+			cache.ghosts[i] = NO_BLOCK;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Empty slot @s, remembering its block if it leaves the 2Q FIFO queue */
+static void slot_release(struct slot *s)
+{
+	if (s->block == NO_BLOCK)
+		return;
+
+	if (s->queue == QUEUE_IN) {
+		cache.nin--;
+		if (cache.policy == CACHE_POLICY_2Q) {
+			cache.ghosts[cache.next_ghost] = s->block;
+			cache.next_ghost = (cache.next_ghost + 1) % cache.nghosts;
+		}
+	}
+	s->block = NO_BLOCK;
+}
+
+/* Make @s hold @block, on queue @queue */
+static void slot_assign(struct slot *s, size_t block, int queue)
+{
+	s->block = block;
+	s->queue = queue;
+	if (queue == QUEUE_IN)
+		cache.nin++;
+	s->last_use = ++cache.clock;
+}
+
+void *cache_get(size_t block)
+{
+	struct slot *s;
+
+	if (!cache.slots) {
+		cache_error("cache not set up");
+		return NULL;
+	}
+
+	s = cache_lookup(block);
+	if (s) {
+		cache.stats.hits++;
+		/* Bursts of use do not move a block up the FIFO queue */
+		if (cache.policy == CACHE_POLICY_LRU || s->queue == QUEUE_MAIN)
+			s->last_use = ++cache.clock;
+		return slot_data(s);
+	}
+
+	cache.stats.misses++;
+	s = cache_victim();
+
+	/* Write back the previous content before reusing the slot */
+	if (s->dirty) {
+		if (block_write(s->block, slot_data(s)))
+			return NULL;
+		s->dirty = 0;
+		cache.stats.writebacks++;
+	}
+
+	if (s->block != NO_BLOCK)
+		cache.stats.evictions++;
+	slot_release(s);
+	if (block_read(block, slot_data(s)))
+		return NULL;
+
+	/* A block used again since it left the FIFO queue is worth keeping */
+	if (cache.policy == CACHE_POLICY_2Q && ghost_remove(block))
+		slot_assign(s, block, QUEUE_MAIN);
+	else
+		slot_assign(s, block, QUEUE_IN);
+
+	return slot_data(s);
+}
+
+int cache_mark_dirty(size_t block)
+{
+	struct slot *s = cache_lookup(block);
+
+	if (!s) {
+		cache_error("block %zu not resident", block);
+		return -1;
+	}
+
+	s->dirty = 1;
+
+	return 0;
+}
+
+int cache_put(size_t block, const void *buf)
+{
+	struct slot *s;
+
+	if (!cache.slots) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	s = cache_lookup(block);
+	if (!s) {
+		/* Never evict anything to make room for a block nobody asked for */
+		s = cache_victim();
+		if (s->block != NO_BLOCK)
+			return -1;
+		slot_assign(s, block, QUEUE_IN);
+	} else if (s->dirty) {
+		/* The cached copy is more recent than @buf */
+		return 0;
+	}
+
+	memcpy(slot_data(s), buf, BLOCK_SIZE);
+
+	return 0;
+}
+
+int cache_pin(size_t block, const void *buf)
+{
+	struct slot *s, *p = NULL;
+
+	if (!cache.slots) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	s = cache_lookup(block);
+	if (s && s >= &cache.slots[cache.nslots])
+		return 0;
+
+	for (size_t i = cache.nslots; i < cache.nslots + cache.npinned; i++) {
+		if (cache.slots[i].block == NO_BLOCK) {
+			p = &cache.slots[i];
+			break;
+		}
+	}
+	if (!p) {
+		cache_error("pinned tier full");
+		return -1;
+	}
+
+	if (s) {
+		/* Move the resident copy over, dirty or not */
+		memcpy(slot_data(p), slot_data(s), BLOCK_SIZE);
+		p->dirty = s->dirty;
+		if (s->queue == QUEUE_IN)
+			cache.nin--;
+		s->block = NO_BLOCK;
+		s->dirty = 0;
+	} else if (buf) {
+		memcpy(slot_data(p), buf, BLOCK_SIZE);
+		p->dirty = 0;
+	} else if (block_read(block, slot_data(p))) {
+		return -1;
+	}
+
+	/* Out of reach of the queues */
+	p->block = block;
+	p->queue = QUEUE_MAIN;
+	p->last_use = ++cache.clock;
+
+	return 0;
+}
+
+/* Write back the dirty slots in @run, which hold consecutive blocks */
+static int cache_write_run(struct slot **run, size_t len)
+{
+	void *bufs[BLOCK_VEC_MAX];
+
+	for (size_t i = 0; i < len; i++)
+		bufs[i] = slot_data(run[i]);
+
+	if (block_write_vec(run[0]->block, len, bufs))
+		return -1;
+
+	for (size_t i = 0; i < len; i++)
+		run[i]->dirty = 0;
+
+	return 0;
+}
+
+int cache_flush(void)
+{
+	struct slot **dirty = cache.dirty;
+	size_t ndirty = 0, start;
+	int ret = 0;
+
+	/* Nothing can be dirty without a cache */
+	if (!cache.slots)
+		return 0;
+
+	/* Collect dirty slots sorted by block index */
+	for (size_t i = 0; i < cache.nslots + cache.npinned; i++) {
+		struct slot *s = &cache.slots[i];
+		size_t j;
+
+		if (!s->dirty)
+			continue;
+		for (j = ndirty; j > 0 && dirty[j - 1]->block > s->block; j--)
+			dirty[j] = dirty[j - 1];
+		dirty[j] = s;
+		ndirty++;
+	}
+
+	/* Coalesce runs of consecutive blocks into single vectored writes */
+	for (start = 0; start < ndirty; ) {
+		size_t len = 1;
+
+		while (start + len < ndirty && len < BLOCK_VEC_MAX
+		       && dirty[start + len]->block == dirty[start]->block + len)
+			len++;
+		if (cache_write_run(&dirty[start], len))
+			ret = -1;
+		start += len;
+	}
+
+	return ret;
+}
+
+int cache_get_stats(struct cache_stats *stats)
+{
+	if (!cache.slots) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	*stats = cache.stats;
+
+	return 0;
+}
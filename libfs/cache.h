@@ -0,0 +1,137 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Default number of blocks the cache keeps resident at once */
+#define CACHE_DEFAULT_SLOTS 32
+
+/** Eviction policies */
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_2Q 1
+
+/**
+ * struct cache_stats - Block cache counters
+ * @hits: Number of cache_get() calls that found the block resident
+ * @misses: Number of cache_get() calls that had to read the block from disk
+ * @evictions: Number of blocks evicted to make room for another one
+ * @writebacks: Number of evicted blocks that had to be written back first
+ */
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks;
+};
+
+/**
+ * cache_init - Set up the block cache
+ * @nslots: Maximum number of blocks resident at the same time, pinned blocks
+ * aside
+ * @npinned: Maximum number of pinned blocks (see cache_pin())
+ * @policy: Eviction policy, %CACHE_POLICY_LRU or %CACHE_POLICY_2Q
+ * @huge_pages: Whether to back the blocks with huge pages where possible
+ *
+ * Allocate room for @nslots blocks, plus a separate tier of @npinned blocks,
+ * in a single arena (see block_arena_alloc()).
+ * Blocks are only read from the virtual disk when first requested through
+ * cache_get() or cache_pin(), so the cost of this call does not depend on the
+ * size of the disk.
+ *
+ * %CACHE_POLICY_LRU evicts the least recently used block. %CACHE_POLICY_2Q
+ * keeps blocks used only once, or only in a short burst, in a small FIFO queue
+ * of their own, and only lets blocks used again after leaving it into the main
+ * LRU queue. A scan through many blocks then only cycles through the FIFO
+ * queue, and leaves the main queue, where the working set lives, alone.
+ *
+ * Return: -1 if @nslots is 0, if @policy is invalid, if the cache is already
+ * set up or if memory cannot be allocated. 0 otherwise.
+ */
+int cache_init(size_t nslots, size_t npinned, int policy, int huge_pages);
+
+/**
+ * cache_destroy - Tear down the block cache
+ *
+ * Drop every cached block without writing it back. Callers that care about
+ * dirty blocks must call cache_flush() first.
+ */
+void cache_destroy(void);
+
+/**
+ * cache_get - Get a cached copy of a block
+ * @block: Index of the block
+ *
+ * Return a pointer to the cached content of block @block (%BLOCK_SIZE bytes),
+ * reading it from disk if it is not resident. Bringing a block in may evict
+ * another one: clean blocks are evicted first, and a dirty block is written
+ * back before its slot is reused. The returned pointer is therefore only valid
+ * until the next call to cache_get().
+ *
+ * Return: NULL if the cache is not set up or if the block cannot be read.
+ * Otherwise a pointer to the block's content.
+ */
+void *cache_get(size_t block);
+
+/**
+ * cache_mark_dirty - Mark a cached block as modified
+ * @block: Index of the block
+ *
+ * Record that the cached copy of block @block has been modified and must be
+ * written back to disk by cache_flush() or upon eviction.
+ *
+ * Return: -1 if block @block is not resident. 0 otherwise.
+ */
+int cache_mark_dirty(size_t block);
+
+/**
+ * cache_put - Seed the cache with a block read by the caller
+ * @block: Index of the block
+ * @buf: Content of the block (%BLOCK_SIZE bytes)
+ *
+ * Make block @block resident with content @buf, as if it had been read by
+ * cache_get(). This lets callers that already fetched a range of blocks avoid
+ * reading them again. A free slot is used if any; no block is ever evicted to
+ * make room, and a dirty cached copy is left untouched.
+ *
+ * Return: -1 if the cache is not set up or is full. 0 otherwise.
+ */
+int cache_put(size_t block, const void *buf);
+
+/**
+ * cache_pin - Keep a block resident for good
+ * @block: Index of the block
+ * @buf: Content of the block (%BLOCK_SIZE bytes), or NULL to read it from disk
+ *
+ * Move block @block to the pinned tier, where it stays until cache_destroy().
+ * It is found by cache_get() like any other block, but it never competes for
+ * slots with the others, so bringing other blocks in never evicts it, nor
+ * writes it back. A resident copy of the block is moved over, dirty or not, in
+ * which case @buf is ignored. Dirty pinned blocks are written back by
+ * cache_flush().
+ *
+ * Return: -1 if the cache is not set up, if the pinned tier is full, or if the
+ * block cannot be read. 0 otherwise.
+ */
+int cache_pin(size_t block, const void *buf);
+
+/**
+ * cache_flush - Write back modified blocks
+ *
+ * Write every dirty block back to disk. Runs of consecutive dirty blocks are
+ * written with a single vectored write. Blocks stay resident and clean.
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @stats: Counters to fill in
+ *
+ * Fill @stats with the counters accumulated since cache_init().
+ *
+ * Return: -1 if the cache is not set up. 0 otherwise.
+ */
+int cache_get_stats(struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -1,8 +1,12 @@
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -13,18 +17,55 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Signature of a delta image, stored at the start of its first block */
+#define OVERLAY_SIG "ECS150OV"
+#define OVERLAY_SIG_LEN 8
+
+/* Size of a huge page on the host */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Number of remap table entries per block */
+#define OVERLAY_ENTRIES_BLK (BLOCK_SIZE / sizeof(uint32_t))
+
+/*
+ * Header block of a delta image. It is followed by the remap table, one
+ * uint32_t per base block giving the delta block that holds its current
+ * content (0 if the block was never written), then by the blocks themselves.
+ */
+struct __attribute__((__packed__)) overlay_header {
+	char signature[OVERLAY_SIG_LEN];
+	uint32_t base_bcount;
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Opened without write access */
+	int read_only;
+	/* Read-only mapping of the whole disk, if requested */
+	void *map;
+	/* Delta image of an overlay (@fd is then the read-only base image) */
+	int delta_fd;
+	/* In-memory copy of the delta's remap table */
+	uint32_t *remap;
+	/* Number of blocks used by the remap table */
+	size_t remap_blocks;
+	/* Next unused block of the delta image */
+	size_t delta_next;
+	/* Content of a RAM disk, and whether it is backed by huge pages */
+	uint8_t *mem;
+	int mem_huge_pages;
+	/* Blocks of the RAM disk were written since it was opened */
+	int mem_dirty;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .delta_fd = INVALID_FD };
 
-int block_disk_open(const char *diskname)
+static int disk_open(const char *diskname, int read_only)
 {
 	int fd;
 	struct stat st;
@@ -39,13 +80,14 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, read_only ? O_RDONLY : O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,25 +95,352 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.read_only = read_only;
+	disk.map = NULL;
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount, int preallocate)
+{
+	int fd, err;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks read as zeroes without ever being written */
+	if (ftruncate(fd, bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	if (preallocate && (err = posix_fallocate(fd, 0, bcount * BLOCK_SIZE))) {
+		block_error("cannot allocate disk space (%s)", strerror(err));
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return disk_open(diskname, 0);
+}
+
+int block_disk_open_ro(const char *diskname)
+{
+	return disk_open(diskname, 1);
+}
+
+/* Size of an arena of @nblocks blocks: whole huge pages if it may use them */
+static size_t arena_size(size_t nblocks, int huge_pages)
+{
+	size_t size = nblocks * BLOCK_SIZE;
+
+	if (huge_pages && size >= HUGE_PAGE_SIZE)
+		size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+			* HUGE_PAGE_SIZE;
+
+	return size;
+}
+
+void *block_arena_alloc(size_t nblocks, int huge_pages)
+{
+	size_t size = arena_size(nblocks, huge_pages);
+	uint8_t *map, *aligned;
+
+	if (!size)
+		size = BLOCK_SIZE;
+
+	if (size % HUGE_PAGE_SIZE || !huge_pages) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			return NULL;
+		}
+		return map;
+	}
+
+	/* Preallocated huge pages, if the host set any aside */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map != MAP_FAILED)
+		return map;
+
+	/*
+	 * Transparent huge pages only back whole aligned huge pages: map one
+	 * more, and trim the unaligned ends
+	 */
+	map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	aligned = (uint8_t *)(((uintptr_t)map + HUGE_PAGE_SIZE - 1)
+			      / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+	if (aligned > map)
+		munmap(map, aligned - map);
+	munmap(aligned + size, map + HUGE_PAGE_SIZE - aligned);
+
+	/* Regular pages remain if the host does not allow huge ones */
+	madvise(aligned, size, MADV_HUGEPAGE);
+
+	return aligned;
+}
+
+void block_arena_free(void *arena, size_t nblocks, int huge_pages)
+{
+	size_t size = arena_size(nblocks, huge_pages);
+
+	if (arena)
+		munmap(arena, size ? size : BLOCK_SIZE);
+}
+
+int block_disk_open_mem(const char *diskname, int huge_pages)
+{
+	size_t size, done;
+	ssize_t ret;
+
+	if (disk_open(diskname, 0))
+		return -1;
+
+	size = disk.bcount * BLOCK_SIZE;
+	disk.mem = block_arena_alloc(disk.bcount, huge_pages);
+	if (!disk.mem) {
+		block_disk_close();
+		return -1;
+	}
+	disk.mem_huge_pages = huge_pages;
+	disk.mem_dirty = 0;
+
+	for (done = 0; done < size; done += ret) {
+		ret = pread(disk.fd, disk.mem + done, size - done, done);
+		if (ret <= 0) {
+			perror("pread");
+			block_disk_close();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Set up a fresh delta image for the base disk that is currently open */
+static int overlay_format(int fd)
+{
+	uint8_t blk[BLOCK_SIZE] = { 0 };
+	struct overlay_header *hdr = (struct overlay_header *)blk;
+
+	memcpy(hdr->signature, OVERLAY_SIG, OVERLAY_SIG_LEN);
+	hdr->base_bcount = disk.bcount;
+
+	/* The remap table starts all zeroes: leave it as a hole */
+	if (ftruncate(fd, (1 + disk.remap_blocks) * BLOCK_SIZE)) {
+		perror("ftruncate");
+		return -1;
+	}
+
+	if (pwrite(fd, blk, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Load the remap table of delta image @fd */
+static int overlay_load(int fd, struct stat *st)
+{
+	uint8_t blk[BLOCK_SIZE];
+	struct overlay_header *hdr = (struct overlay_header *)blk;
+	size_t table_bytes = disk.remap_blocks * BLOCK_SIZE;
+
+	if (pread(fd, blk, BLOCK_SIZE, 0) != BLOCK_SIZE
+	    || memcmp(hdr->signature, OVERLAY_SIG, OVERLAY_SIG_LEN)
+	    || hdr->base_bcount != disk.bcount) {
+		block_error("delta image does not belong to this base image");
+		return -1;
+	}
+
+	if (st->st_size % BLOCK_SIZE != 0
+	    || (size_t)st->st_size < (1 + disk.remap_blocks) * BLOCK_SIZE) {
+		block_error("delta image is truncated");
+		return -1;
+	}
+
+	if (pread(fd, disk.remap, table_bytes, BLOCK_SIZE)
+	    != (ssize_t)table_bytes) {
+		perror("pread");
+		return -1;
+	}
+
+	/* New blocks go after the last one in use */
+	disk.delta_next = 1 + disk.remap_blocks;
+	for (size_t i = 0; i < disk.bcount; i++) {
+		if (disk.remap[i] >= st->st_size / BLOCK_SIZE) {
+			block_error("corrupted remap table");
+			return -1;
+		}
+		if (disk.remap[i] >= disk.delta_next)
+			disk.delta_next = disk.remap[i] + 1;
+	}
+
+	return 0;
+}
+
+/* Format or load delta image @fd */
+static int overlay_attach(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		disk.delta_next = 1 + disk.remap_blocks;
+		return overlay_format(fd);
+	}
+
+	return overlay_load(fd, &st);
+}
+
+int block_disk_open_overlay(const char *basename, const char *deltaname)
+{
+	int fd;
+
+	if (!deltaname) {
+		block_error("invalid file deltaname");
+		return -1;
+	}
+
+	if (disk_open(basename, 1))
+		return -1;
+
+	disk.remap_blocks = (disk.bcount + OVERLAY_ENTRIES_BLK - 1)
+		/ OVERLAY_ENTRIES_BLK;
+	disk.remap = calloc(disk.remap_blocks, BLOCK_SIZE);
+	if (!disk.remap) {
+		perror("calloc");
+		block_disk_close();
+		return -1;
+	}
+
+	if ((fd = open(deltaname, O_RDWR | O_CREAT, 0644)) < 0) {
+		perror("open");
+		block_disk_close();
+		return -1;
+	}
+
+	if (overlay_attach(fd)) {
+		close(fd);
+		block_disk_close();
+		return -1;
+	}
+
+	disk.delta_fd = fd;
+	/* Writes go to the delta image */
+	disk.read_only = 0;
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
+	size_t size, done;
+	ssize_t ret;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
+	/*
+	 * Write a modified RAM disk back in one go, and make sure it reached the
+	 * host's disk. Until it did, the RAM disk stays open so that closing it
+	 * can be retried.
+	 */
+	if (disk.mem && disk.mem_dirty) {
+		size = disk.bcount * BLOCK_SIZE;
+		for (done = 0; done < size; done += ret) {
+			ret = pwrite(disk.fd, disk.mem + done, size - done, done);
+			if (ret <= 0) {
+				perror("pwrite");
+				return -1;
+			}
+		}
+		if (fsync(disk.fd)) {
+			perror("fsync");
+			return -1;
+		}
+		disk.mem_dirty = 0;
+	}
+
+	if (disk.mem)
+		block_arena_free(disk.mem, disk.bcount, disk.mem_huge_pages);
+
+	if (disk.map)
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
 	close(disk.fd);
+	if (disk.delta_fd != INVALID_FD)
+		close(disk.delta_fd);
+	free(disk.remap);
 
 	disk.fd = INVALID_FD;
+	disk.map = NULL;
+	disk.delta_fd = INVALID_FD;
+	disk.remap = NULL;
+	disk.mem = NULL;
+
+	return 0;
+}
+
+int block_disk_grow(size_t bcount)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.read_only || disk.delta_fd != INVALID_FD || disk.map
+	    || disk.mem) {
+		block_error("disk cannot grow");
+		return -1;
+	}
+
+	if (bcount < disk.bcount) {
+		block_error("block count '%zu' is smaller than '%zu'", bcount,
+			    disk.bcount);
+		return -1;
+	}
+
+	/* New blocks read as zeroes, like those of a new disk */
+	if (ftruncate(disk.fd, bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		return -1;
+	}
+	disk.bcount = bcount;
 
 	return 0;
 }
@@ -86,6 +455,78 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+const void *block_disk_map(void)
+{
+	void *map;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (disk.map)
+		return disk.map;
+
+	/* A RAM disk is in memory already */
+	if (disk.mem)
+		return disk.mem;
+
+	if (disk.delta_fd != INVALID_FD) {
+		block_error("cannot map an overlay");
+		return NULL;
+	}
+
+	if (!disk.bcount) {
+		block_error("empty disk");
+		return NULL;
+	}
+
+	/*
+	 * Shared mapping: every process mapping the same disk file uses the
+	 * same page cache pages
+	 */
+	map = mmap(NULL, disk.bcount * BLOCK_SIZE, PROT_READ, MAP_SHARED,
+		   disk.fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	disk.map = map;
+
+	return map;
+}
+
+/*
+ * Give @block its own block in the delta image, write @buf to it and persist
+ * the mapping. The data goes first, so that the table never points at a block
+ * that was not written.
+ */
+static int overlay_remap(size_t block, const void *buf)
+{
+	size_t tblk = block / OVERLAY_ENTRIES_BLK;
+
+	if (pwrite(disk.delta_fd, buf, BLOCK_SIZE,
+		   (off_t)disk.delta_next * BLOCK_SIZE) != BLOCK_SIZE) {
+		perror("pwrite");
+		return -1;
+	}
+
+	disk.remap[block] = disk.delta_next;
+
+	/* Only the table block holding the new entry needs to be written */
+	if (pwrite(disk.delta_fd, &disk.remap[tblk * OVERLAY_ENTRIES_BLK],
+		   BLOCK_SIZE, (1 + tblk) * BLOCK_SIZE) != BLOCK_SIZE) {
+		perror("pwrite");
+		disk.remap[block] = 0;
+		return -1;
+	}
+
+	disk.delta_next++;
+
+	return 0;
+}
+
 int block_write(size_t block, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
@@ -93,21 +534,40 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
+	if (disk.read_only) {
+		block_error("disk opened read-only");
+		return -1;
+	}
+
 	if (block >= disk.bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
 			    block, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	if (disk.mem) {
+		memcpy(disk.mem + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		disk.mem_dirty = 1;
+		return 0;
+	}
+
+	/* Unmodified blocks of an overlay are copied up on first write */
+	if (disk.delta_fd != INVALID_FD) {
+		if (!disk.remap[block])
+			return overlay_remap(block, buf);
+
+		if (pwrite(disk.delta_fd, buf, BLOCK_SIZE,
+			   (off_t)disk.remap[block] * BLOCK_SIZE) < 0) {
+			perror("pwrite");
+			return -1;
+		}
+
+		return 0;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/* Perform the actual write into the disk image at the block's offset */
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
@@ -127,16 +587,184 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.mem) {
+		memcpy(buf, disk.mem + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	/* Modified blocks of an overlay live in the delta image */
+	if (disk.delta_fd != INVALID_FD && disk.remap[block]) {
+		if (pread(disk.delta_fd, buf, BLOCK_SIZE,
+			  (off_t)disk.remap[block] * BLOCK_SIZE) < 0) {
+			perror("pread");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* Perform the actual read from the disk image at the block's offset */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return 0;
+}
+
+/* Build the I/O vector for @nblocks consecutive blocks starting at @block */
+static int block_iov(size_t block, size_t nblocks, void *const bufs[],
+		     struct iovec *iov)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!nblocks || nblocks > BLOCK_VEC_MAX) {
+		block_error("invalid block count (%zu)", nblocks);
+		return -1;
+	}
+
+	if (block + nblocks > disk.bcount) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, nblocks, disk.bcount);
+		return -1;
+	}
+
+	for (size_t i = 0; i < nblocks; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+int block_write_vec(size_t block, size_t nblocks, void *const bufs[])
+{
+	struct iovec iov[BLOCK_VEC_MAX];
+
+	if (block_iov(block, nblocks, bufs, iov))
+		return -1;
+
+	if (disk.read_only) {
+		block_error("disk opened read-only");
+		return -1;
+	}
+
+	/* Blocks of an overlay are scattered across the delta image */
+	if (disk.delta_fd != INVALID_FD || disk.mem) {
+		for (size_t i = 0; i < nblocks; i++)
+			if (block_write(block + i, bufs[i]))
+				return -1;
+		return 0;
+	}
+
+	/* One system call for the whole run of blocks */
+	if (pwritev(disk.fd, iov, nblocks, block * BLOCK_SIZE)
+	    != (ssize_t)(nblocks * BLOCK_SIZE)) {
+		perror("pwritev");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_read_vec(size_t block, size_t nblocks, void *const bufs[])
+{
+	struct iovec iov[BLOCK_VEC_MAX];
+
+	if (block_iov(block, nblocks, bufs, iov))
 		return -1;
+
+	if (disk.mem) {
+		for (size_t i = 0; i < nblocks; i++)
+			memcpy(bufs[i], disk.mem + (block + i) * BLOCK_SIZE,
+			       BLOCK_SIZE);
+		return 0;
+	}
+
+	/* Fall back to single reads unless the whole run is in the base image */
+	if (disk.delta_fd != INVALID_FD) {
+		for (size_t i = 0; i < nblocks; i++) {
+			if (disk.remap[block + i]) {
+				for (i = 0; i < nblocks; i++)
+					if (block_read(block + i, bufs[i]))
+						return -1;
+				return 0;
+			}
+		}
+	}
+
+	/* One system call for the whole run of blocks */
+	if (preadv(disk.fd, iov, nblocks, block * BLOCK_SIZE)
+	    != (ssize_t)(nblocks * BLOCK_SIZE)) {
+		perror("preadv");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_advise(size_t block, size_t nblocks, int advice)
+{
+	static const int madvice[] = {
+		[BLOCK_ADV_NORMAL] = MADV_NORMAL,
+		[BLOCK_ADV_SEQUENTIAL] = MADV_SEQUENTIAL,
+		[BLOCK_ADV_RANDOM] = MADV_RANDOM,
+		[BLOCK_ADV_WILLNEED] = MADV_WILLNEED,
+		[BLOCK_ADV_DONTNEED] = MADV_DONTNEED,
+	};
+	int fadvice, err;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (advice < BLOCK_ADV_NORMAL || advice > BLOCK_ADV_DONTNEED) {
+		block_error("invalid advice (%d)", advice);
+		return -1;
+	}
+
+	if (block + nblocks > disk.bcount) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, nblocks, disk.bcount);
+		return -1;
+	}
+
+	/* A RAM disk has nothing to read ahead nor to drop */
+	if (!nblocks || disk.mem)
+		return 0;
+
+	/* The readahead policy of a mapping is kept per range of pages */
+	if (disk.map && madvise((uint8_t *)disk.map + block * BLOCK_SIZE,
+				nblocks * BLOCK_SIZE, madvice[advice])) {
+		perror("madvise");
+		return -1;
+	}
+
+	if (advice == BLOCK_ADV_WILLNEED)
+		fadvice = POSIX_FADV_WILLNEED;
+	else if (advice == BLOCK_ADV_DONTNEED)
+		fadvice = POSIX_FADV_DONTNEED;
+	else
+		return 0;
+
+	if ((err = posix_fadvise(disk.fd, block * BLOCK_SIZE,
+				 nblocks * BLOCK_SIZE, fadvice))) {
+		block_error("cannot advise (%s)", strerror(err));
+		return -1;
+	}
+
+	/* Modified blocks of an overlay live in the delta image */
+	if (disk.delta_fd != INVALID_FD) {
+		for (size_t i = block; i < block + nblocks; i++) {
+			if (disk.remap[i])
+				posix_fadvise(disk.delta_fd,
+					      (off_t)disk.remap[i] * BLOCK_SIZE,
+					      BLOCK_SIZE, fadvice);
+		}
 	}
 
 	return 0;
@@ -6,6 +6,22 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ * @preallocate: Whether to allocate the disk space up front
+ *
+ * Create virtual disk file @diskname with @bcount blocks that all read as
+ * zeroes, replacing any existing file. Unless @preallocate is set, the file is
+ * sparse: no zeroes are written and disk space is only used as blocks get
+ * written. The virtual disk file is not left open.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be
+ * created, or if the disk space cannot be allocated. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, int preallocate);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,13 +35,81 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_ro - Open virtual disk file without write access
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open(), but the virtual disk file is opened read-only:
+ * block_write() and block_write_vec() fail until it is closed. Blocks can be
+ * read concurrently from several threads.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open. 0 otherwise.
+ */
+int block_disk_open_ro(const char *diskname);
+
+/**
+ * block_disk_open_overlay - Open a base disk file with a writable delta
+ * @basename: Name of the base virtual disk file
+ * @deltaname: Name of the delta image file
+ *
+ * Open virtual disk file @basename read-only, and stack the delta image
+ * @deltaname on top of it. Blocks are read from the base disk until they are
+ * first written; the written content then goes to a block appended to the delta
+ * image, and a remap table stored at the start of the delta image records where
+ * each modified block lives. If @deltaname does not exist or is empty, it is
+ * created as a sparse file holding an empty remap table.
+ *
+ * The base disk is never modified, so many overlays can share it. The disk
+ * seen through block_read() and block_write() has the base disk's block count.
+ *
+ * Return: -1 if either file name is invalid, if a file cannot be opened, if a
+ * virtual disk is already open, or if @deltaname is not a delta image of
+ * @basename. 0 otherwise.
+ */
+int block_disk_open_overlay(const char *basename, const char *deltaname);
+
+/**
+ * block_disk_open_mem - Open virtual disk file as a RAM disk
+ * @diskname: Name of the virtual disk file
+ * @huge_pages: Whether to back the RAM disk with huge pages where possible
+ *
+ * Same as block_disk_open(), but the whole content of virtual disk file
+ * @diskname is read into memory (see block_arena_alloc()), and every block is
+ * then read from and written to memory. Blocks written are only written back to
+ * @diskname by block_disk_close(), all at once. The disk cannot grow.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or read, if a disk is already open, or if memory cannot be allocated. 0
+ * otherwise.
+ */
+int block_disk_open_mem(const char *diskname, int huge_pages);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * The blocks of a RAM disk (see block_disk_open_mem()) that were written are
+ * written back to its virtual disk file first, and synced to the host's disk.
+ * If that fails, the RAM disk is left open, so that the call can be retried.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a RAM disk cannot
+ * be written back. 0 otherwise.
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_grow - Extend the virtual disk
+ * @bcount: New number of blocks
+ *
+ * Extend the currently open virtual disk file to @bcount blocks. The new blocks
+ * are read as zeroes until written, and take no space on the host until then.
+ *
+ * Return: -1 if there was no virtual disk file opened, if it is read-only,
+ * mapped or an overlay, if @bcount is smaller than its current block count, or
+ * if it cannot be extended. 0 otherwise.
+ */
+int block_disk_grow(size_t bcount);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,6 +118,19 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_map - Map the whole disk in memory
+ *
+ * Map the content of the currently open virtual disk read-only in the address
+ * space of the process. Block i starts at offset i * %BLOCK_SIZE of the
+ * mapping. The mapping is shared: processes mapping the same virtual disk file
+ * share the same physical pages. It stays valid until block_disk_close().
+ *
+ * Return: NULL if there was no virtual disk file opened, if it is an overlay,
+ * or if it cannot be mapped. Otherwise a pointer to the first byte of the disk.
+ */
+const void *block_disk_map(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -42,8 +139,8 @@ int block_disk_count(void);
  * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
  * block @block.
  *
- * Return: -1 if @block is out of bounds or inaccessible or if the writing
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible, if the disk was opened
+ * read-only, or if the writing operation fails. 0 otherwise.
  */
 int block_write(size_t block, const void *buf);
 
@@ -60,4 +157,87 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/** Maximum number of blocks transferred by a single vectored operation */
+#define BLOCK_VEC_MAX 64
+
+/**
+ * block_write_vec - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @nblocks: Number of blocks to write
+ * @bufs: Array of @nblocks data buffers, one per block
+ *
+ * Write the content of buffers @bufs (%BLOCK_SIZE bytes each) in the virtual
+ * disk's blocks @block to @block + @nblocks - 1, using a single system call.
+ *
+ * Return: -1 if @nblocks is 0 or larger than %BLOCK_VEC_MAX, if the range is
+ * out of bounds or inaccessible or if the writing operation fails. 0 otherwise.
+ */
+int block_write_vec(size_t block, size_t nblocks, void *const bufs[]);
+
+/**
+ * block_read_vec - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @nblocks: Number of blocks to read
+ * @bufs: Array of @nblocks data buffers, one per block
+ *
+ * Read the content of virtual disk's blocks @block to @block + @nblocks - 1
+ * into buffers @bufs (%BLOCK_SIZE bytes each), using a single system call.
+ *
+ * Return: -1 if @nblocks is 0 or larger than %BLOCK_VEC_MAX, if the range is
+ * out of bounds or inaccessible, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_read_vec(size_t block, size_t nblocks, void *const bufs[]);
+
+/** Access pattern advice for block_advise() */
+#define BLOCK_ADV_NORMAL 0
+#define BLOCK_ADV_SEQUENTIAL 1
+#define BLOCK_ADV_RANDOM 2
+#define BLOCK_ADV_WILLNEED 3
+#define BLOCK_ADV_DONTNEED 4
+
+/**
+ * block_advise - Announce how blocks are going to be accessed
+ * @block: Index of the first block
+ * @nblocks: Number of blocks
+ * @advice: One of the %BLOCK_ADV_* values
+ *
+ * Pass a hint about virtual disk's blocks @block to @block + @nblocks - 1 on to
+ * the host. %BLOCK_ADV_WILLNEED starts reading them in the background, and
+ * %BLOCK_ADV_DONTNEED drops their cached copies. %BLOCK_ADV_NORMAL,
+ * %BLOCK_ADV_SEQUENTIAL and %BLOCK_ADV_RANDOM set the readahead policy of the
+ * blocks' range in the mapping of the disk (see block_disk_map()). Without a
+ * mapping, the host keeps a single readahead policy for the whole disk file, so
+ * they are ignored. The content of the blocks is never affected.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @advice is invalid,
+ * if the range is out of bounds, or if the host rejects the hint. 0 otherwise.
+ */
+int block_advise(size_t block, size_t nblocks, int advice);
+
+/**
+ * block_arena_alloc - Allocate memory for blocks
+ * @nblocks: Number of blocks
+ * @huge_pages: Whether to use huge pages where possible
+ *
+ * Allocate zeroed memory for @nblocks blocks, aligned on a page. Random
+ * accesses to a large arena miss the TLB on most accesses with regular pages,
+ * so if @huge_pages is set and the arena spans at least one huge page, it is
+ * backed by preallocated huge pages (MAP_HUGETLB) if the host has any left, or
+ * else by transparent huge pages (MADV_HUGEPAGE) if the host allows them, or
+ * else by regular pages.
+ *
+ * Return: NULL if memory cannot be allocated. Otherwise the arena, to be
+ * released with block_arena_free().
+ */
+void *block_arena_alloc(size_t nblocks, int huge_pages);
+
+/**
+ * block_arena_free - Release memory allocated for blocks
+ * @arena: Memory returned by block_arena_alloc(), or NULL
+ * @nblocks: Number of blocks, as given to block_arena_alloc()
+ * @huge_pages: As given to block_arena_alloc()
+ */
+void block_arena_free(void *arena, size_t nblocks, int huge_pages);
+
 #endif /* _DISK_H */
@@ -1,16 +1,40 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
 
 #define FAT_EOC 0xFFFF
+// Data block no longer used by the live file system, but still referenced by a snapshot. It is neither free nor part of any live chain.
+#define FAT_SNAP 0xFFFE
 
 #define SIG_LEN 8
 
+// Snapshot table entry, stored in the spare bytes of the superblock. An empty name denotes an unused entry.
+struct __attribute__((__packed__)) snapshot_entry {
+	char name[FS_FILENAME_LEN];
+	// First data block of the chain holding the saved FAT blocks, followed by the saved root directory.
+	uint16_t idx_first_meta_blk;
+};
+
+// Checkpoint table entry, stored in the spare bytes of the superblock. An empty name denotes an unused entry.
+struct __attribute__((__packed__)) checkpoint_entry {
+	char name[FS_FILENAME_LEN];
+	// First data block of the chain holding the bitmap of blocks changed since the checkpoint.
+	uint16_t idx_first_map_blk;
+};
+
 // Superblock data structure
 struct __attribute__((__packed__)) superblock {
 	uint8_t signature[SIG_LEN];
@@ -19,12 +43,77 @@ struct __attribute__((__packed__)) superblock {
 	uint16_t data_blk_start_idx;
 	uint16_t amt_data_blks;
 	uint8_t num_blks_fat;
-	uint8_t padding[4079];
+	struct snapshot_entry snapshots[FS_SNAPSHOT_MAX_COUNT];
+	struct checkpoint_entry checkpoints[FS_CHECKPOINT_MAX_COUNT];
+	// Data block holding the dedup index, or 0 if deduplication is off.
+	uint16_t idx_dedup_blk;
+	// Data block the log resumes at, or 0 if the volume is not log-structured.
+	uint16_t log_head;
+	uint8_t padding[4079 - FS_SNAPSHOT_MAX_COUNT * sizeof(struct snapshot_entry) - FS_CHECKPOINT_MAX_COUNT * sizeof(struct checkpoint_entry) - 2 * sizeof(uint16_t)];
 };
 const uint8_t specified_signature[SIG_LEN] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
 
 #define NUM_ENTRIES_FAT_BLK 2048
 
+// Changed-block bitmaps cover every block of the disk, so they take at most this many blocks.
+#define CBT_MAX_BLKS ((UINT16_MAX + 1) / 8 / BLOCK_SIZE)
+
+// Header of a file of changed blocks, followed by one (uint32_t block index, block content) record per block.
+#define CHANGES_SIG "ECS150CB"
+struct __attribute__((__packed__)) changes_header {
+	uint8_t signature[SIG_LEN];
+	uint32_t tot_amt_blks;
+	uint32_t num_blks;
+};
+
+// Superblock, FAT and root directory of a volume of up to 8192 data blocks span this many blocks. Larger volumes have the rest of their FAT paged in lazily.
+#define MOUNT_PREFETCH_BLKS 6
+
+// A log-structured volume writes its data blocks in segments of this many blocks, each filled from first to last before the log moves on to a clean one.
+#define LOG_SEGMENT_BLKS BLOCK_VEC_MAX
+// Clean segments kept for the cleaner to move blocks to.
+#define LOG_RESERVE_SEGS 1
+
+// Sequential readers get blocks asked for ahead of them, in a window that starts at this many blocks and doubles up to a vector's worth.
+#define READAHEAD_MIN_BLKS 4
+#define READAHEAD_MAX_BLKS BLOCK_VEC_MAX
+// The host caches file data in folios of up to 2 MiB and only drops the ones lying wholly within the range it is told about, so blocks behind a reader are dropped this many at a time, along with the previous batch.
+#define DROP_BEHIND_BLKS 512
+// Reads of at least this many whole blocks are split into runs of up to a vector's worth, read concurrently by up to this many threads. Threads waiting on the disk take no CPU, so their number follows the requests worth keeping in flight rather than the CPU count.
+#define PARALLEL_READ_MIN_BLKS (8 * BLOCK_VEC_MAX)
+#define PARALLEL_READ_MAX_THREADS 8
+
+// Dedup index entry: a chain shared by every file with the same content. An entry without references is unused.
+struct __attribute__((__packed__)) dedup_entry {
+	uint64_t hash;
+	uint16_t idx_first_data_blk;
+	uint16_t refcount;
+};
+
+// Dedup index, stored in a single data block. There are never more distinct chains than files.
+struct __attribute__((__packed__)) dedup_block {
+	struct dedup_entry entries[FS_FILE_MAX_COUNT];
+	uint8_t padding[BLOCK_SIZE - FS_FILE_MAX_COUNT * sizeof(struct dedup_entry)];
+};
+
+// Packed image: a read-only format for published images. The header is followed by the directory, the offsets of the compressed chunks within the image, then the chunks.
+#define PACK_SIG "ECS150PK"
+// Files are cut into chunks of this size, compressed separately so that reads only decompress what they need.
+#define PACK_CHUNK_SIZE (8 * BLOCK_SIZE)
+struct __attribute__((__packed__)) pack_header {
+	uint8_t signature[SIG_LEN];
+	uint32_t num_files;
+	// The offset table has one more entry, where the last chunk ends.
+	uint32_t num_chunks;
+};
+
+// Packed directory entry. Entries are sorted by name, and a file's content lies in consecutive chunks. A chunk whose compressed size is its uncompressed size is stored as is.
+struct __attribute__((__packed__)) pack_dir_entry {
+	char filename[FS_FILENAME_LEN];
+	uint32_t size_file;
+	uint32_t idx_first_chunk;
+};
+
 // FAT data structure
 struct __attribute__((__packed__)) fat_block {
 	uint16_t next_data_blk[NUM_ENTRIES_FAT_BLK];
@@ -36,7 +125,41 @@ struct __attribute__((__packed__)) root_dir_entry {
 	char filename[FS_FILENAME_LEN];
 	uint32_t size_file;
 	uint16_t idx_first_data_blk;
-	uint8_t padding[10];
+	// Number of blocks of a ring file, all allocated when it is created, or 0 for a regular file.
+	uint16_t ring_num_blks;
+	// Offset of the oldest byte of a ring file within its blocks.
+	uint32_t ring_start;
+	uint8_t padding[4];
+};
+
+// Run of consecutive data blocks of a file, starting at block @logical of the file.
+struct extent {
+	uint32_t logical;
+	uint16_t physical;
+	uint16_t length;
+};
+
+// Extents of a file sorted by logical block, built from its FAT chain so that seeking within the file is a binary search rather than a walk of the chain.
+struct extent_map {
+	struct extent *extents;
+	size_t num_extents;
+	size_t max_extents;
+	// Number of blocks of the chain.
+	size_t num_blks;
+	// The FAT generation and first data block of the chain the map was built from. Generation 0 denotes no map.
+	unsigned generation;
+	uint16_t idx_first_data_blk;
+};
+
+// Last block written through a file descriptor, where its next append starts.
+struct file_tail {
+	// The FAT generation and first data block of the chain the tail was found in. Generation 0 denotes no tail.
+	unsigned generation;
+	uint16_t idx_first_data_blk;
+	// Index of the block within the file, the block itself, and the one before it.
+	size_t idx_blk;
+	uint16_t blk;
+	uint16_t prev;
 };
 
 // File descriptor data structure
@@ -44,588 +167,4055 @@ struct file_descriptor {
 	int idx_file_root_dir;
 	int file_descriptor;
 	size_t file_offset;
+	// Written to since it was opened.
+	int modified;
+	// Opened by fs_open_append(): every write goes to the end of the file.
+	int append;
+	struct file_tail tail;
+	// Access pattern given to fs_fadvise(). Sequential readers also track the file offset blocks were asked for up to, and the size of the next window.
+	int advice;
+	size_t readahead_end;
+	size_t readahead_blks;
 };
 
 // Virgin block representations, for cleaning purposes upon an unmount call.
 static const struct superblock clean_superblock;
-#define CLEAN_FAT NULL
 static const struct root_dir_entry clean_root_dir_entry;
 
 static struct superblock superblock;
-// To be allocated once we know how many blocks are necessary.
-static struct fat_block* fat;
-static struct root_dir_entry root_directory[FS_FILE_MAX_COUNT];
+// FAT blocks are not kept in memory as a whole, but paged in on demand through the block cache.
+static struct root_dir_entry rw_root_directory[FS_FILE_MAX_COUNT];
+// Points to rw_root_directory, or straight into the mapped image on a read-only mount.
+static struct root_dir_entry *root_directory = rw_root_directory;
 
 static int num_open_fds = 0;
 static const struct file_descriptor empty_FD = {
 	.idx_file_root_dir = -1,
 	.file_descriptor = 0,
-	.file_offset = 0
+	.file_offset = 0,
+	.modified = 0,
+	.append = 0,
+	.advice = FS_FADV_NORMAL
 };
 static struct file_descriptor FD[FS_OPEN_MAX_COUNT];
 
 // For tracking purposes.
 static int fs_mounted = 0;
+// Eviction policy the block cache was set up with.
+static int cache_policy = FS_CACHE_LRU;
 static int num_files_root_dir = 0;
 static int num_avail_data_blks = 0;
+// Where the allocator resumes its search for a free FAT entry.
+static uint16_t next_free_hint = 1;
 
-int fs_mount(const char *diskname)
-{
-	if (block_disk_open(diskname)) {
-		return -1;
-	}
-
-	block_read(0, &superblock);
+// Set by fs_mount_ro(). The whole image is then mapped read-only and shared with every other process mapping it, so the FAT, root directory and data blocks are read in place, without locks nor private copies.
+static int fs_read_only = 0;
+static const uint8_t *ro_image = NULL;
+// Each FAT block within the mapping. They are not contiguous when a snapshot is mounted.
+static const struct fat_block *ro_fat[UINT8_MAX];
+// Set by fs_mount_ro() on a packed image, pointing within the mapping. Its directory is copied to the root directory, so that only reading file content differs.
+static const struct pack_header *pack_image = NULL;
+static const struct pack_dir_entry *pack_directory = NULL;
+static const uint64_t *pack_chunks = NULL;
+// Bumped on every packed mount, so that a chunk a thread decompressed from a previous image is never taken for one of the current image.
+static unsigned pack_generation = 0;
+// Last chunk decompressed by each thread, since sequential reads come back for the rest of it.
+static __thread struct {
+	unsigned generation;
+	uint32_t idx_chunk;
+	uint8_t data[PACK_CHUNK_SIZE];
+} pack_last;
 
-	// Required error checks. An improper signature exists, or the provided amount of blocks does not correspond to that given by the Block API.
-	if (memcmp(superblock.signature, specified_signature, SIG_LEN) || superblock.tot_amt_blks != block_disk_count()) {
-		return -1;
-	}
+// Data blocks allocated when any existing snapshot was taken. Those are shared with the snapshot and must be copied before being modified. Computed on first use.
+static uint8_t snap_frozen[(UINT16_MAX + 1) / 8];
+static int snap_frozen_loaded = 0;
+// Data blocks holding the saved metadata of snapshots, which no snapshot shares with the live file system.
+static uint8_t snap_meta[(UINT16_MAX + 1) / 8];
 
-	fat = (struct fat_block*)malloc(superblock.num_blks_fat * sizeof(struct fat_block));
+// In-memory copy of the changed-block bitmap of each checkpoint, written back along with the rest of the metadata. Loaded on first use.
+static uint8_t cbt_map[FS_CHECKPOINT_MAX_COUNT][CBT_MAX_BLKS * BLOCK_SIZE];
+static int cbt_dirty[FS_CHECKPOINT_MAX_COUNT];
+static int cbt_loaded = 0;
 
-	// Read FAT blocks in one by one.
-	int i = 1;
-	while (i <= superblock.num_blks_fat) {
-		block_read(i, &(fat[i - 1]));
-		i++;
-	}
+// In-memory copy of the dedup index, written back along with the rest of the metadata. Loaded on first use.
+static struct dedup_block dedup_index;
+static int dedup_loaded = 0;
+static int dedup_dirty = 0;
 
-	block_read(i, &root_directory);
+// On a log-structured volume, data blocks freed since the last checkpoint. The metadata on disk may still refer to them, so they are not reused before the next one.
+static uint8_t log_freed[(UINT16_MAX + 1) / 8];
+static int log_num_freed = 0;
+// Blocks appended to the log since the last checkpoint.
+static int log_num_appended = 0;
+// Set when the log runs short of clean segments, so that one is cleaned once the current operation is done.
+static int log_need_clean = 0;
+// Set when blocks freed since the last checkpoint are all that keeps segments from being clean, so that one is written once the current operation is done. Writing it in the middle of an operation could save chains that the root directory does not account for yet.
+static int log_need_checkpoint = 0;
+// Set while the cleaner moves blocks, whose allocations must not ask for more cleaning.
+static int log_cleaning = 0;
 
-	// Denote that initially, no file is associated with any of these unopened file descriptors. Since we use a non-default value (-1) to represent a lack of corresponding filename, this step is essential.
-	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
-		FD[j] = empty_FD;
-	}
+// Extent map of each file of the root directory. Any change to the FAT makes them all out of date.
+static struct extent_map extent_maps[FS_FILE_MAX_COUNT];
+static unsigned fat_generation = 1;
 
-	fs_mounted = 1;
-	// First data entry can never be written (always FAT_EOC) in FAT.
-	num_avail_data_blks = superblock.amt_data_blks - 1;
-	return 0;
-}
+static void cbt_mark(size_t block);
+static uint16_t log_alloc(void);
 
-int fs_umount(void)
+// Read entry @idx of the FAT, paging in the FAT block that holds it if necessary. Returns FAT_EOC if the block cannot be read, which ends any chain walk.
+static uint16_t fat_get(uint16_t idx)
 {
-	if (!fs_mounted || num_open_fds > 0 || block_disk_close()) {
-		return -1;
-	}
-
-	// Clean up our metadata blocks.
-	superblock = clean_superblock;
-	free(fat);
-	fat = CLEAN_FAT;
-	// We have to reset our root directory entry by entry, due to its implementation's static nature.
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		root_directory[i] = clean_root_dir_entry;
+	if (ro_image != NULL) {
+		return ro_fat[idx / NUM_ENTRIES_FAT_BLK]->next_data_blk[idx % NUM_ENTRIES_FAT_BLK];
 	}
 
-	// Clean up our file descriptor table.
-	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
-		FD[j] = empty_FD;
+	struct fat_block *fat_blk = cache_get(1 + idx / NUM_ENTRIES_FAT_BLK);
+	if (fat_blk == NULL) {
+		return FAT_EOC;
 	}
 
-	fs_mounted = 0;
-	num_avail_data_blks = 0;
-	return 0;
+	return fat_blk->next_data_blk[idx % NUM_ENTRIES_FAT_BLK];
 }
 
-int fs_info(void)
+// Update entry @idx of the FAT. The FAT block is only written back on the next flush or when evicted from the cache.
+static int fat_set(uint16_t idx, uint16_t value)
 {
-	if (block_disk_count() < 0) {
+	size_t blk = 1 + idx / NUM_ENTRIES_FAT_BLK;
+	struct fat_block *fat_blk = cache_get(blk);
+	if (fat_blk == NULL) {
 		return -1;
 	}
 
-	fprintf(stdout, "FS Info:\n");
-	fprintf(stdout, "total_blk_count=%d\n", superblock.tot_amt_blks);
-	fprintf(stdout, "fat_blk_count=%d\n", superblock.num_blks_fat);
-	fprintf(stdout, "rdir_blk=%d\n", 1 + superblock.num_blks_fat);
-	fprintf(stdout, "data_blk=%d\n", 1 + superblock.num_blks_fat + 1);
-	fprintf(stdout, "data_blk_count=%d\n", superblock.amt_data_blks);
-
-	int data_blk_ctr = 0;
-	int num_free_data_blks = 0;
-	for (int i = 0; i < superblock.num_blks_fat; i++) {
-		for (int j = 0; j < NUM_ENTRIES_FAT_BLK; j++) {
-			// Don't count extra bytes unused by the FAT.
-			if (data_blk_ctr >= superblock.amt_data_blks) {
-				break;
-			}
-
-			if (fat[i].next_data_blk[j] == 0) {
-				num_free_data_blks++;
-			}
+	fat_blk->next_data_blk[idx % NUM_ENTRIES_FAT_BLK] = value;
+	fat_generation++;
+	cbt_mark(blk);
+	return cache_mark_dirty(blk);
+}
 
-			data_blk_ctr++;
-		}
+// Whether data block @idx was freed since the last checkpoint of a log-structured volume.
+static int log_is_freed(uint16_t idx)
+{
+	return log_freed[idx / 8] & (1 << (idx % 8));
+}
 
-		// Seemingly redundant but necessary, to avoid use of goto.
-		if (data_blk_ctr >= superblock.amt_data_blks) {
-			break;
+// Find a free data block, mark it as the end of a chain and return its index, or FAT_EOC if the disk is full.
+static uint16_t fat_alloc(void)
+{
+	// A log-structured volume appends to its log for as long as it has clean segments, and only then fills holes.
+	if (superblock.log_head != 0) {
+		uint16_t idx = log_alloc();
+		if (idx != FAT_EOC) {
+			return idx;
 		}
 	}
 
-	fprintf(stdout, "fat_free_ratio=%d/%d\n", num_free_data_blks, superblock.amt_data_blks);
+	// First data entry can never be allocated (always FAT_EOC) in FAT.
+	for (int n = 1; n < superblock.amt_data_blks; n++) {
+		uint16_t idx = next_free_hint;
+		next_free_hint = next_free_hint + 1 < superblock.amt_data_blks ? next_free_hint + 1 : 1;
 
-	// Recycling this variable.
-	num_free_data_blks = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] == '\0') {
-			num_free_data_blks++;
+		if (fat_get(idx) == 0 && !log_is_freed(idx)) {
+			if (fat_set(idx, FAT_EOC)) {
+				return FAT_EOC;
+			}
+			num_avail_data_blks--;
+			return idx;
 		}
 	}
 
-	fprintf(stdout, "rdir_free_ratio=%d/%d\n", num_free_data_blks, FS_FILE_MAX_COUNT);
+	return FAT_EOC;
+}
 
-	return 0;
+// Number of blocks of a changed-block bitmap for the mounted disk.
+static int cbt_num_blks(void)
+{
+	return ((superblock.tot_amt_blks + 7) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
-static int is_invalid_file(const char* filename) {
-	for (int i = 0; i <= FS_FILENAME_LEN; i++) {
-		if (i == FS_FILENAME_LEN) {
-			return 1;
+// Read the changed-block bitmap of every checkpoint.
+static int cbt_load(void)
+{
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		cbt_dirty[i] = 0;
+		if (superblock.checkpoints[i].name[0] == '\0') {
+			continue;
 		}
 
-		if (filename[i] == '\0') {
-			return 0;
+		uint16_t cur = superblock.checkpoints[i].idx_first_map_blk;
+		for (int j = 0; j < cbt_num_blks() && cur != FAT_EOC; j++) {
+			if (block_read(superblock.data_blk_start_idx + cur, &cbt_map[i][j * BLOCK_SIZE])) {
+				return -1;
+			}
+			cur = fat_get(cur);
 		}
 	}
 
-	// We should never get here.
-	return -1;
+	cbt_loaded = 1;
+	return 0;
 }
 
-int fs_create(const char *filename)
+// Record that @block was modified, in every checkpoint's bitmap.
+static void cbt_mark(size_t block)
 {
-	if (!fs_mounted || num_files_root_dir >= FS_FILE_MAX_COUNT || is_invalid_file(filename)) {
-		return -1;
-	}
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (superblock.checkpoints[i].name[0] == '\0') {
+			continue;
+		}
 
-	// Find the file in the root directory.
-	int x;
-	for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
-		if (!strcmp(filename, root_directory[x].filename)) {
-			break;
+		if (!cbt_loaded && cbt_load()) {
+			return;
 		}
-	}
 
-	// The file already exists.
-	if (x < FS_FILE_MAX_COUNT) {
-		return -1;
+		if (!(cbt_map[i][block / 8] & (1 << (block % 8)))) {
+			cbt_map[i][block / 8] |= 1 << (block % 8);
+			cbt_dirty[i] = 1;
+		}
 	}
+}
 
-	int entry = 0;
-	while (entry < FS_FILE_MAX_COUNT) {
-		// Find the first empty entry in the root directory.
-		if (root_directory[entry].filename[0] == '\0') {
-			break;
+// Write back the modified changed-block bitmaps. Their own blocks are not tracked.
+static int cbt_flush(void)
+{
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (!cbt_dirty[i] || superblock.checkpoints[i].name[0] == '\0') {
+			continue;
 		}
 
-		entry++;
-	}
-
-	// Fill it in.
-	int i;
-	for (i = 0; i < (int)strlen(filename); i++) {
-		root_directory[entry].filename[i] = filename[i];
+		uint16_t cur = superblock.checkpoints[i].idx_first_map_blk;
+		for (int j = 0; j < cbt_num_blks() && cur != FAT_EOC; j++) {
+			if (block_write(superblock.data_blk_start_idx + cur, &cbt_map[i][j * BLOCK_SIZE])) {
+				return -1;
+			}
+			cur = fat_get(cur);
+		}
+		cbt_dirty[i] = 0;
 	}
-	root_directory[entry].filename[i] = '\0';
-	root_directory[entry].size_file = 0;
-	root_directory[entry].idx_first_data_blk = FAT_EOC;
-	num_files_root_dir++;
-
-	// Update disk.
-	block_write(superblock.root_dir_blk_idx, &root_directory);
 
 	return 0;
 }
 
-int fs_delete(const char *filename)
+// Write a block to disk, recording the change for incremental backups.
+static int tracked_write(size_t block, const void *buf)
 {
-	if (!fs_mounted || is_invalid_file(filename)) {
-		return -1;
-	}
-
-	int x;
-	for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
-		if (!strcmp(filename, root_directory[x].filename)) {
-			break;
-		}
-	}
+	cbt_mark(block);
+	return block_write(block, buf);
+}
 
-	// The file does not exist in the file system.
-	if (x >= FS_FILE_MAX_COUNT) {
+// Read the dedup index.
+static int dedup_load(void)
+{
+	if (block_read(superblock.data_blk_start_idx + superblock.idx_dedup_blk, &dedup_index)) {
 		return -1;
 	}
 
-	// The file is currently open.
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (FD[i].idx_file_root_dir == x) {
-			return -1;
-		}
-	}
+	dedup_loaded = 1;
+	dedup_dirty = 0;
+	return 0;
+}
 
-	// No need to free space for empty files.
-	if (root_directory[x].idx_first_data_blk != FAT_EOC) {
-		// Find the location in the FAT that corresponds to the beginning of the file.
-		int block = root_directory[x].idx_first_data_blk / NUM_ENTRIES_FAT_BLK;
-		uint16_t entry = root_directory[x].idx_first_data_blk % NUM_ENTRIES_FAT_BLK;
-		while (fat[block].next_data_blk[entry] != FAT_EOC) {
-			uint16_t next_location = fat[block].next_data_blk[entry];
-			// Delete each key to the file's contents.
-			fat[block].next_data_blk[entry] = 0;
-			num_avail_data_blks++;
-			// Find the next FAT block with the file's data.
-			block = next_location / NUM_ENTRIES_FAT_BLK;
-			entry = next_location % NUM_ENTRIES_FAT_BLK;
-		}
-		// Free the final bytes.
-		fat[block].next_data_blk[entry] = 0;
+// Write back the dedup index if it was modified.
+static int dedup_flush(void)
+{
+	if (!dedup_dirty || superblock.idx_dedup_blk == 0) {
+		return 0;
 	}
 
-	// Empty the entry in the root directory.
-	root_directory[x].filename[0] = '\0';
-	root_directory[x].size_file = 0;
-	root_directory[x].idx_first_data_blk = FAT_EOC;
-
-	// Write all potentially modified data back to disk.
-	int i = 1;
-	while (i <= superblock.num_blks_fat) {
-		block_write(i, &(fat[i - 1]));
-		i++;
+	if (tracked_write(superblock.data_blk_start_idx + superblock.idx_dedup_blk, &dedup_index)) {
+		return -1;
 	}
-	block_write(i, &root_directory);
 
+	dedup_dirty = 0;
 	return 0;
 }
 
-int fs_ls(void)
+// Dedup index entry of the chain starting at data block @idx, or NULL if the chain is not in the index.
+static struct dedup_entry *dedup_find(uint16_t idx)
 {
-	if (!fs_mounted) {
-		return -1;
+	if (superblock.idx_dedup_blk == 0 || idx == FAT_EOC || (!dedup_loaded && dedup_load())) {
+		return NULL;
 	}
 
-	fprintf(stdout, "FS Ls:\n");
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] != '\0') {
-			fprintf(stdout, "file: %s, size: %d, data_blk: %d\n", root_directory[i].filename, root_directory[i].size_file, root_directory[i].idx_first_data_blk);
+		if (dedup_index.entries[i].refcount > 0 && dedup_index.entries[i].idx_first_data_blk == idx) {
+			return &dedup_index.entries[i];
 		}
 	}
 
-	return 0;
+	return NULL;
 }
 
-int fs_open(const char *filename)
+// First file before file @x that shares its deduplicated chain, or -1. Only that file owns the chain as far as walking it is concerned.
+static int dedup_primary(int x)
 {
-	if (!fs_mounted || num_open_fds >= FS_OPEN_MAX_COUNT || is_invalid_file(filename)) {
+	uint16_t first = root_directory[x].idx_first_data_blk;
+	if (first == FAT_EOC || dedup_find(first) == NULL) {
 		return -1;
 	}
 
-	int i;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp(filename, root_directory[i].filename)) {
-			break;
+	for (int y = 0; y < x; y++) {
+		if (root_directory[y].filename[0] != '\0' && root_directory[y].idx_first_data_blk == first) {
+			return y;
 		}
 	}
 
-	if (i >= FS_FILE_MAX_COUNT) {
-		return -1;
-	}
+	return -1;
+}
 
-	int fd_idx = 0;
-	// This file descriptor is already open.
-	while (FD[fd_idx].file_descriptor != 0) {
-		fd_idx++;
+// Number of files whose chain starts at data block @idx.
+static int dedup_count_refs(uint16_t idx)
+{
+	int count = 0;
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		count += root_directory[x].filename[0] != '\0' && root_directory[x].idx_first_data_blk == idx;
 	}
 
-	FD[fd_idx].file_descriptor = fd_idx + 1;
-	// Redundant, but for readability.
-	FD[fd_idx].file_offset = 0;
-	FD[fd_idx].idx_file_root_dir = i;
-
-	num_open_fds++;
-
-	return FD[fd_idx].file_descriptor;
+	return count;
 }
 
-int fs_close(int fd)
+// Write the root directory and every modified FAT block back to disk. The root directory follows the last FAT block, so all of them usually leave with a single vectored write.
+static int metadata_flush(void)
 {
-	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT) {
+	void *root_blk = cache_get(superblock.root_dir_blk_idx);
+	if (root_blk == NULL) {
 		return -1;
 	}
-	
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (FD[i].file_descriptor == fd) {
-			break;
+
+	memcpy(root_blk, root_directory, BLOCK_SIZE);
+	cache_mark_dirty(superblock.root_dir_blk_idx);
+	cbt_mark(superblock.root_dir_blk_idx);
+
+	// On a log-structured volume this is a checkpoint: the superblock, which holds the head of the log, is written along with the FAT and the root directory, in the same run.
+	if (superblock.log_head != 0) {
+		void *super_blk = cache_get(0);
+		if (super_blk == NULL) {
+			return -1;
 		}
+		memcpy(super_blk, &superblock, BLOCK_SIZE);
+		cache_mark_dirty(0);
+		cbt_mark(0);
 	}
 
-	// This file descriptor is not open.
-	if (i >= FS_OPEN_MAX_COUNT) {
+	if (cbt_flush() || dedup_flush() || cache_flush()) {
 		return -1;
 	}
 
-	// This is how we denote an unopened file descriptor.
-	FD[i].file_descriptor = 0;
-	FD[i].file_offset = 0;
-	FD[i].idx_file_root_dir = -1;
-
-	num_open_fds--;
-
+	// Nothing on disk refers to blocks freed before the checkpoint anymore.
+	if (log_num_freed > 0) {
+		memset(log_freed, 0, sizeof(log_freed));
+		log_num_freed = 0;
+	}
+	log_num_appended = 0;
+	log_need_checkpoint = 0;
 	return 0;
 }
 
-int fs_stat(int fd)
+// Find the snapshot named @name, or return -1.
+static int snap_find(const char *name)
 {
-	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT) {
-		return -1;
-	}
-	
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (FD[i].file_descriptor == fd) {
-			break;
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (superblock.snapshots[i].name[0] != '\0' && !strncmp(name, superblock.snapshots[i].name, FS_FILENAME_LEN)) {
+			return i;
 		}
 	}
 
-	// This file descriptor is not open.
-	if (i == FS_OPEN_MAX_COUNT) {
-		return -1;
-	}
-
-	return root_directory[FD[i].idx_file_root_dir].size_file;
+	return -1;
 }
 
-int fs_lseek(int fd, size_t offset)
+// Rebuild the set of blocks holding the saved metadata of every snapshot, walking each chain through the live FAT.
+static void snap_load_meta(void)
 {
-	int size_file = fs_stat(fd);
-	if (size_file == -1 || (int)offset > size_file) {
-		return -1;
-	}
-	
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		// Guaranteed to exist, for similar reasons.
-		if (FD[i].file_descriptor == fd) {
-			break;
+	memset(snap_meta, 0, sizeof(snap_meta));
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (superblock.snapshots[i].name[0] == '\0') {
+			continue;
 		}
-	}
 
-	FD[i].file_offset = offset;
+		uint16_t cur = superblock.snapshots[i].idx_first_meta_blk;
+		for (int j = 0; j <= superblock.num_blks_fat && cur < superblock.amt_data_blks; j++) {
+			snap_meta[cur / 8] |= 1 << (cur % 8);
+			cur = fat_get(cur);
+		}
+	}
+}
 
-	return 0;
+// Whether FAT entry @idx, of value @value, points to a block a snapshot saving the FAT shares with the live file system. Neither the saved metadata of snapshots nor blocks only older snapshots hold on to are.
+static int snap_shares(uint16_t idx, uint16_t value)
+{
+	return value != 0 && value != FAT_SNAP && !(snap_meta[idx / 8] & (1 << (idx % 8)));
 }
 
-int fs_write(int fd, void *buf, size_t count)
+// Rebuild the set of data blocks shared with snapshots, from the FAT saved in each of them.
+static int snap_load_frozen(void)
 {
-	// Error checking. 
-	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT || buf == NULL){
-		return -1;
-	}
+	struct fat_block saved;
 
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (FD[i].file_descriptor == fd) {
-			break;
+	snap_load_meta();
+	memset(snap_frozen, 0, sizeof(snap_frozen));
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (superblock.snapshots[i].name[0] == '\0') {
+			continue;
+		}
+
+		uint16_t cur = superblock.snapshots[i].idx_first_meta_blk;
+		for (int j = 0; j < superblock.num_blks_fat && cur != FAT_EOC; j++) {
+			if (block_read(superblock.data_blk_start_idx + cur, &saved)) {
+				return -1;
+			}
+
+			for (int k = 0; k < NUM_ENTRIES_FAT_BLK; k++) {
+				int idx = j * NUM_ENTRIES_FAT_BLK + k;
+				if (idx < superblock.amt_data_blks && snap_shares(idx, saved.next_data_blk[k])) {
+					snap_frozen[idx / 8] |= 1 << (idx % 8);
+				}
+			}
+			cur = fat_get(cur);
 		}
 	}
 
-	// This file descriptor is not open.
-	if (i == FS_OPEN_MAX_COUNT) {
-		return -1;
+	snap_frozen_loaded = 1;
+	return 0;
+}
+
+// Whether data block @idx is shared with a snapshot.
+static int snap_is_frozen(uint16_t idx)
+{
+	if (!snap_frozen_loaded && snap_load_frozen()) {
+		// Err on the safe side: copying a block needlessly is better than corrupting a snapshot.
+		return 1;
 	}
 
-	int x = FD[i].idx_file_root_dir;
-	int j = root_directory[x].idx_first_data_blk;
+	return snap_frozen[idx / 8] & (1 << (idx % 8));
+}
+
+// Free the chain starting at data block @idx, and return the number of freed blocks. Blocks that a snapshot still uses are kept aside rather than freed.
+static int chain_free(uint16_t idx)
+{
+	int num_freed = 0;
 
-	uint16_t file_blocks[superblock.amt_data_blks];
+	while (idx != FAT_EOC) {
+		uint16_t next_location = fat_get(idx);
+		if (snap_is_frozen(idx)) {
+			fat_set(idx, FAT_SNAP);
+		} else {
+			fat_set(idx, 0);
+			num_avail_data_blks++;
+			num_freed++;
+		}
+		idx = next_location;
+	}
+
+	return num_freed;
+}
+
+// Hash the first @size bytes held by the chain starting at data block @idx (64-bit FNV-1a).
+static int dedup_hash(uint16_t idx, size_t size, uint64_t *hash)
+{
+	uint8_t blk[BLOCK_SIZE];
+
+	*hash = 0xcbf29ce484222325ULL;
+	for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+		if (idx == FAT_EOC || block_read(superblock.data_blk_start_idx + idx, blk)) {
+			return -1;
+		}
 
-	for (int k = 0; k < superblock.amt_data_blks; k++) {
-		file_blocks[k] = FAT_EOC;
+		size_t len = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+		for (size_t i = 0; i < len; i++) {
+			*hash = (*hash ^ blk[i]) * 0x100000001b3ULL;
+		}
+		idx = fat_get(idx);
 	}
-	// If first_data_blk is not empty
-	int counter = 0;
-	if (j != FAT_EOC) {
-		file_blocks[0] = superblock.data_blk_start_idx + j;
-	
-		int block = j / NUM_ENTRIES_FAT_BLK;
-		uint16_t entry = j % NUM_ENTRIES_FAT_BLK;
 
-		counter++;
-		while (fat[block].next_data_blk[entry] != FAT_EOC) {
-			uint16_t next_location = fat[block].next_data_blk[entry];
-			// Delete each key to the file's contents.
-			file_blocks[counter] = superblock.data_blk_start_idx + next_location;
-			// Find the next FAT block with the file's data.
-			block = next_location / NUM_ENTRIES_FAT_BLK;
-			entry = next_location % NUM_ENTRIES_FAT_BLK;
-			counter++;
+	return 0;
+}
+
+// Whether the chains starting at data blocks @a and @b hold the same first @size bytes. Hashes only tell which chains may be equal.
+static int dedup_same_content(uint16_t a, uint16_t b, size_t size)
+{
+	uint8_t blk_a[BLOCK_SIZE];
+	uint8_t blk_b[BLOCK_SIZE];
+
+	for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+		if (a == FAT_EOC || b == FAT_EOC || block_read(superblock.data_blk_start_idx + a, blk_a) || block_read(superblock.data_blk_start_idx + b, blk_b)) {
+			return 0;
+		}
+
+		size_t len = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+		if (memcmp(blk_a, blk_b, len)) {
+			return 0;
 		}
+		a = fat_get(a);
+		b = fat_get(b);
 	}
-	uint8_t* file_blocks_array = counter == 0 ? NULL : (uint8_t*)malloc(counter * BLOCK_SIZE * sizeof(uint8_t));
-	int t = 0;
-	while (file_blocks[t] != FAT_EOC) {
-		block_read(file_blocks[t], &file_blocks_array[t*BLOCK_SIZE]);
-		t++;
+
+	return 1;
+}
+
+// Make file @x share the chain of a file with the same content if there is one, or else record its content in the dedup index. Return the number of blocks freed.
+static int dedup_file(int x)
+{
+	uint16_t first = root_directory[x].idx_first_data_blk;
+	size_t size = root_directory[x].size_file;
+	// A ring file keeps its blocks to itself.
+	if (superblock.idx_dedup_blk == 0 || first == FAT_EOC || size == 0 || root_directory[x].ring_num_blks != 0 || dedup_find(first) != NULL) {
+		return 0;
 	}
 
-	int offset = FD[i].file_offset;
-	size_t actual_count = count;
-	if (count > root_directory[x].size_file - offset) {
-		actual_count = root_directory[x].size_file - offset;
+	uint64_t hash;
+	if (dedup_hash(first, size, &hash)) {
+		return -1;
 	}
-	memcpy(&file_blocks_array[offset], buf, actual_count);
 
-	int z = actual_count;
+	struct dedup_entry *unused = NULL;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct dedup_entry *entry = &dedup_index.entries[i];
+		if (entry->refcount == 0) {
+			unused = unused != NULL ? unused : entry;
+			continue;
+		}
 
-	// While there are still more characters to write.
-	while (z < (int)count) {
-		// While there is still space in the block.
-		while (counter != 0 && ((z + offset) / (counter * BLOCK_SIZE) == 0)) {
-			// There is nothing left to write with a block that still has space.
-			if (z == (int)count){
+		int y;
+		for (y = 0; y < FS_FILE_MAX_COUNT; y++) {
+			if (root_directory[y].filename[0] != '\0' && root_directory[y].idx_first_data_blk == entry->idx_first_data_blk) {
 				break;
 			}
-			memcpy(&file_blocks_array[z + offset], buf + z, 1);
-			z++;
-			(root_directory[x].size_file)++;
+		}
+		if (entry->hash != hash || y == FS_FILE_MAX_COUNT || root_directory[y].size_file != size || !dedup_same_content(entry->idx_first_data_blk, first, size)) {
+			continue;
 		}
 
-		// While there is still more to write, but
-		// we are at the end of the block.
-		if (z < (int)count) {
-			// If no more data blocks to spare, stop writing.
-			if (num_avail_data_blks == 0) {
-				break;
+		// Same content: the file's own chain is no longer needed.
+		root_directory[x].idx_first_data_blk = entry->idx_first_data_blk;
+		entry->refcount++;
+		dedup_dirty = 1;
+		return chain_free(first);
+	}
+
+	// There are never more chains in the index than files, so an entry is always available.
+	unused->hash = hash;
+	unused->idx_first_data_blk = first;
+	unused->refcount = 1;
+	dedup_dirty = 1;
+	return 0;
+}
+
+// Prepare file @x for being modified: its content no longer matches the dedup index, and a chain shared with other files must first be copied.
+static int dedup_unshare(int x)
+{
+	struct dedup_entry *entry = dedup_find(root_directory[x].idx_first_data_blk);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	dedup_dirty = 1;
+	if (entry->refcount == 1) {
+		entry->refcount = 0;
+		return 0;
+	}
+
+	uint8_t blk[BLOCK_SIZE];
+	uint16_t first = FAT_EOC;
+	uint16_t prev = FAT_EOC;
+	for (uint16_t cur = entry->idx_first_data_blk; cur != FAT_EOC; cur = fat_get(cur)) {
+		uint16_t copy = fat_alloc();
+		if (copy == FAT_EOC || block_read(superblock.data_blk_start_idx + cur, blk) || tracked_write(superblock.data_blk_start_idx + copy, blk)) {
+			// Not enough space: give back what was taken.
+			if (copy != FAT_EOC) {
+				fat_set(copy, 0);
+				num_avail_data_blks++;
+			}
+			if (first != FAT_EOC) {
+				chain_free(first);
 			}
+			return -1;
+		}
 
-			// Else, allocate another data block and keep going.
-			else {
-				uint16_t v = root_directory[x].idx_first_data_blk;
+		if (prev == FAT_EOC) {
+			first = copy;
+		} else {
+			fat_set(prev, copy);
+		}
+		prev = copy;
+	}
 
-				// Must update idx_first_data_blk if empty file being written to.
+	root_directory[x].idx_first_data_blk = first;
+	entry->refcount--;
+	return 0;
+}
 
-				int block = v / NUM_ENTRIES_FAT_BLK;
-				uint16_t entry = v % NUM_ENTRIES_FAT_BLK;
-				// This loop finds the last block of the current file (0xFFFF).
-				if (v != FAT_EOC) {
-					while (fat[block].next_data_blk[entry] != FAT_EOC) {
-						uint16_t next_location = fat[block].next_data_blk[entry];
-						block = next_location / NUM_ENTRIES_FAT_BLK;
-						entry = next_location % NUM_ENTRIES_FAT_BLK;
-					}
-				}	
-				for (int c = 0; c < superblock.num_blks_fat; c++) {
-					for (int d = 0; d < NUM_ENTRIES_FAT_BLK; d++) {
-						if (fat[c].next_data_blk[d] == 0) {
-							if (v != FAT_EOC) {
-								fat[block].next_data_blk[entry] = c * NUM_ENTRIES_FAT_BLK + d;
-							}
-							// This is the new last block that contains the curent block.
-							fat[c].next_data_blk[d] = FAT_EOC;
-							file_blocks[counter] = (c * NUM_ENTRIES_FAT_BLK + d) + superblock.data_blk_start_idx;
-
-							if (v == FAT_EOC) {
-								root_directory[x].idx_first_data_blk = c * NUM_ENTRIES_FAT_BLK + d; 
-							}
-							// Increases the file_blocks array so we can add another block to it.
-							file_blocks_array = (uint8_t*)realloc(file_blocks_array, (counter + 1) * BLOCK_SIZE * sizeof(uint8_t));
-
-							block_read(file_blocks[counter], &file_blocks_array[counter * BLOCK_SIZE]);
-
-							counter++;
-							num_avail_data_blks--;
-							break;
-						}
-					}
-					break;
-				}
+// Free data block @idx of a log-structured volume. It is only reused after the next checkpoint.
+static void log_free(uint16_t idx)
+{
+	fat_set(idx, 0);
+	log_freed[idx / 8] |= 1 << (idx % 8);
+	log_num_freed++;
+	num_avail_data_blks++;
+}
+
+static size_t log_num_segments(void)
+{
+	return (superblock.amt_data_blks + LOG_SEGMENT_BLKS - 1) / LOG_SEGMENT_BLKS;
+}
+
+// Number of data blocks of segment @seg that cannot be allocated: those in use, and those freed since the last checkpoint. Sets @num_blks to the number of blocks of the segment. Data block 0 is never allocated, so it does not count.
+static size_t log_segment_used(size_t seg, size_t *num_blks)
+{
+	size_t num_used = 0;
+	*num_blks = 0;
+	for (size_t idx = seg * LOG_SEGMENT_BLKS; idx < (seg + 1) * LOG_SEGMENT_BLKS && idx < superblock.amt_data_blks; idx++) {
+		if (idx == 0) {
+			continue;
+		}
+		(*num_blks)++;
+		if (fat_get(idx) != 0 || log_is_freed(idx)) {
+			num_used++;
+		}
+	}
+
+	return num_used;
+}
+
+// First clean segment from segment @seg on, wrapping around, or -1 if there is none. Sets @num_clean to the number of clean segments.
+static int log_find_clean(size_t seg, int *num_clean)
+{
+	int found = -1;
+	*num_clean = 0;
+	for (size_t n = 0; n < log_num_segments(); n++) {
+		size_t cur = (seg + n) % log_num_segments();
+		size_t num_blks;
+		if (log_segment_used(cur, &num_blks) == 0 && num_blks > 0) {
+			if (found < 0) {
+				found = cur;
 			}
-			
+			(*num_clean)++;
 		}
 	}
 
-	int l = 0;
-	while (file_blocks[l] != FAT_EOC) {
-		block_write(file_blocks[l], &file_blocks_array[l * BLOCK_SIZE]);
-		l++;
+	return found;
+}
+
+// Allocate the data block at the head of the log. Once the head reaches the end of its segment, the log moves on to the next clean segment. Returns FAT_EOC if there is none left.
+static uint16_t log_alloc(void)
+{
+	uint16_t idx = superblock.log_head;
+	if (idx >= superblock.amt_data_blks || idx % LOG_SEGMENT_BLKS == 0 || fat_get(idx) != 0 || log_is_freed(idx)) {
+		size_t from = idx < superblock.amt_data_blks ? idx / LOG_SEGMENT_BLKS : 0;
+		int num_clean;
+		int seg = log_find_clean(from, &num_clean);
+
+		// Blocks freed since the last checkpoint may be all that keeps segments from being clean.
+		if (num_clean <= LOG_RESERVE_SEGS + 1 && log_num_freed > 0 && !log_cleaning) {
+			log_need_checkpoint = 1;
+		}
+
+		// Blocks cannot be moved in the middle of an operation, which may hold some of them. Cleaning waits for it to be over, so it must start before the reserve is used up.
+		if (num_clean <= LOG_RESERVE_SEGS + 1 && !log_cleaning) {
+			log_need_clean = 1;
+		}
+
+		if (seg < 0) {
+			return FAT_EOC;
+		}
+		idx = seg == 0 ? 1 : seg * LOG_SEGMENT_BLKS;
 	}
 
-	free(file_blocks_array);
+	if (fat_set(idx, FAT_EOC)) {
+		return FAT_EOC;
+	}
+	num_avail_data_blks--;
+	superblock.log_head = idx + 1;
+	log_num_appended++;
+	return idx;
+}
 
-	block_write(superblock.root_dir_blk_idx, &root_directory);
+// Move data block @idx of a file to the head of the log. @prev holds the predecessor of every block of a file (see log_clean()), and is kept up to date.
+static int log_move(uint16_t idx, uint16_t *prev)
+{
+	uint8_t buf[BLOCK_SIZE];
+	uint16_t copy = fat_alloc();
+	if (copy == FAT_EOC) {
+		return -1;
+	}
+	if (block_read(superblock.data_blk_start_idx + idx, buf) || tracked_write(superblock.data_blk_start_idx + copy, buf)) {
+		fat_set(copy, 0);
+		num_avail_data_blks++;
+		return -1;
+	}
 
-	int y = 1;
-	while (y <= superblock.num_blks_fat) {
-		block_write(y, &(fat[y - 1]));
-		y++;
+	uint16_t next = fat_get(idx);
+	fat_set(copy, next);
+	if (prev[idx] != FAT_EOC) {
+		fat_set(prev[idx], copy);
+	} else {
+		// Every file sharing a deduplicated chain starts with it.
+		for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+			if (root_directory[x].filename[0] != '\0' && root_directory[x].idx_first_data_blk == idx) {
+				root_directory[x].idx_first_data_blk = copy;
+			}
+		}
+		struct dedup_entry *entry = dedup_find(idx);
+		if (entry != NULL) {
+			entry->idx_first_data_blk = copy;
+			dedup_dirty = 1;
+		}
 	}
 
-	return z;
+	if (next < superblock.amt_data_blks) {
+		prev[next] = copy;
+	}
+	prev[copy] = prev[idx];
+	prev[idx] = 0;
+	log_free(idx);
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+// Clean the segment with the fewest live blocks, if it has at most @max_live of them, by moving them to the head of the log, then write a checkpoint so that the segment can be reused. Liveness comes from the FAT. Only blocks of files are moved: segments holding blocks shared with a snapshot, or internal metadata, are left alone. Returns 1 if a segment was cleaned, 0 if none could be.
+static int log_clean(size_t max_live)
 {
-	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT || buf == NULL){
+	// Predecessor of each block of a file: the previous block of its chain, or FAT_EOC for the first one. 0 for blocks no file reaches.
+	uint16_t *prev = calloc(UINT16_MAX + 1, sizeof(uint16_t));
+	if (prev == NULL) {
 		return -1;
 	}
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (root_directory[x].filename[0] == '\0') {
+			continue;
+		}
 
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (FD[i].file_descriptor == fd) {
+		uint16_t p = FAT_EOC;
+		for (uint16_t cur = root_directory[x].idx_first_data_blk; cur != 0 && cur < superblock.amt_data_blks && prev[cur] == 0; cur = fat_get(cur)) {
+			prev[cur] = p;
+			p = cur;
+		}
+	}
+
+	// The moved blocks go to clean segments and what is left of the head's, rather than to holes of the segment being cleaned.
+	int num_clean;
+	log_find_clean(0, &num_clean);
+	size_t room = num_clean * LOG_SEGMENT_BLKS;
+	if (superblock.log_head < superblock.amt_data_blks && superblock.log_head % LOG_SEGMENT_BLKS != 0) {
+		room += LOG_SEGMENT_BLKS - superblock.log_head % LOG_SEGMENT_BLKS;
+	}
+
+	int victim = -1;
+	size_t victim_used = (max_live < room ? max_live : room) + 1;
+	for (size_t seg = 0; seg < log_num_segments(); seg++) {
+		size_t num_blks;
+		size_t num_used = log_segment_used(seg, &num_blks);
+		if (seg == superblock.log_head / LOG_SEGMENT_BLKS || num_used == 0 || num_used >= num_blks || num_used >= victim_used) {
+			continue;
+		}
+
+		int movable = 1;
+		for (size_t idx = seg * LOG_SEGMENT_BLKS; idx < (seg + 1) * LOG_SEGMENT_BLKS && idx < superblock.amt_data_blks && movable; idx++) {
+			if (idx != 0 && fat_get(idx) != 0 && (prev[idx] == 0 || snap_is_frozen(idx))) {
+				movable = 0;
+			}
+		}
+		if (movable) {
+			victim = seg;
+			victim_used = num_used;
+		}
+	}
+
+	if (victim < 0) {
+		free(prev);
+		return 0;
+	}
+
+	int ret = 0;
+	log_cleaning = 1;
+	for (size_t idx = victim * LOG_SEGMENT_BLKS; idx < (size_t)(victim + 1) * LOG_SEGMENT_BLKS && idx < superblock.amt_data_blks && ret == 0; idx++) {
+		if (idx != 0 && !log_is_freed(idx) && fat_get(idx) != 0) {
+			ret = log_move(idx, prev);
+		}
+	}
+	log_cleaning = 0;
+	free(prev);
+
+	if (metadata_flush() || ret) {
+		return -1;
+	}
+	return 1;
+}
+
+// Clean segments until the log has more clean segments than its reserve again, or cleaning gains nothing.
+static void log_replenish(void)
+{
+	for (size_t n = 0; n < log_num_segments(); n++) {
+		int num_clean;
+		log_find_clean(0, &num_clean);
+		if (num_clean > LOG_RESERVE_SEGS + 1 || log_clean(LOG_SEGMENT_BLKS) <= 0) {
 			break;
 		}
 	}
+}
 
-	// This file descriptor is not open.
-	if (i == FS_OPEN_MAX_COUNT) {
+// Mount the file system of the virtual disk that was just opened, for reading and writing.
+static int mount_disk(const struct fs_mount_options *options)
+{
+	// Fetch the whole metadata region with a single read. Its exact extent is only known once the superblock is parsed, so read as much as the largest volume needs.
+	static uint8_t prefetch[MOUNT_PREFETCH_BLKS][BLOCK_SIZE];
+	void *prefetch_bufs[MOUNT_PREFETCH_BLKS];
+	int num_prefetched = block_disk_count() < MOUNT_PREFETCH_BLKS ? block_disk_count() : MOUNT_PREFETCH_BLKS;
+	for (int i = 0; i < num_prefetched; i++) {
+		prefetch_bufs[i] = prefetch[i];
+	}
+
+	if (num_prefetched < 1 || block_read_vec(0, num_prefetched, prefetch_bufs)) {
+		block_disk_close();
 		return -1;
 	}
+	memcpy(&superblock, prefetch[0], BLOCK_SIZE);
 
-	int x = FD[i].idx_file_root_dir;
-	int j = root_directory[x].idx_first_data_blk;
+	// Required error checks. An improper signature exists, or the provided amount of blocks does not correspond to that given by the Block API.
+	if (memcmp(superblock.signature, specified_signature, SIG_LEN) || superblock.tot_amt_blks != block_disk_count()) {
+		superblock = clean_superblock;
+		block_disk_close();
+		return -1;
+	}
+
+	// Remaining FAT blocks are read lazily, so mount cost does not scale with the size of the volume.
+	// Pinned metadata gets a tier of its own: the superblock, the FAT and the root directory.
+	size_t num_pinned = options->pin_metadata ? (size_t)superblock.root_dir_blk_idx + 1 : 0;
+	if (cache_init(options->cache_slots != 0 ? options->cache_slots : CACHE_DEFAULT_SLOTS, num_pinned, options->cache_policy == FS_CACHE_2Q ? CACHE_POLICY_2Q : CACHE_POLICY_LRU, !options->regular_pages)) {
+		superblock = clean_superblock;
+		block_disk_close();
+		return -1;
+	}
+	cache_policy = options->cache_policy;
 
-	uint16_t file_blocks[superblock.amt_data_blks];
+	// Hand the prefetched FAT and root directory blocks to the cache. Pinned ones are all read now.
+	if (options->pin_metadata) {
+		for (int i = 0; i <= superblock.root_dir_blk_idx; i++) {
+			if (cache_pin(i, i < num_prefetched ? prefetch[i] : NULL)) {
+				cache_destroy();
+				superblock = clean_superblock;
+				block_disk_close();
+				return -1;
+			}
+		}
+	} else {
+		for (int i = 1; i < num_prefetched && i <= superblock.root_dir_blk_idx; i++) {
+			cache_put(i, prefetch[i]);
+		}
+	}
 
-	for (int k = 0; k < superblock.amt_data_blks; k++) {
-		file_blocks[k] = FAT_EOC;
+	if (superblock.root_dir_blk_idx < num_prefetched) {
+		memcpy(root_directory, prefetch[superblock.root_dir_blk_idx], BLOCK_SIZE);
+	} else {
+		block_read(superblock.root_dir_blk_idx, root_directory);
 	}
 
-	// If first_data_blk is not empty
-	int counter = 0;
-	if (j != FAT_EOC) {
-		file_blocks[counter] = superblock.data_blk_start_idx + j;
-	
-		int block = j / NUM_ENTRIES_FAT_BLK;
-		uint16_t entry = j % NUM_ENTRIES_FAT_BLK;
-		counter++;
-		while (fat[block].next_data_blk[entry] != FAT_EOC) {
-			uint16_t next_location = fat[block].next_data_blk[entry];
-			// Delete each key to the file's contents.
-			file_blocks[counter] = superblock.data_blk_start_idx + next_location;
-			// Find the next FAT block with the file's data.
-			block = next_location / NUM_ENTRIES_FAT_BLK;
-			entry = next_location % NUM_ENTRIES_FAT_BLK;
-			counter++;
+	// Denote that initially, no file is associated with any of these unopened file descriptors. Since we use a non-default value (-1) to represent a lack of corresponding filename, this step is essential.
+	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+		FD[j] = empty_FD;
+	}
+
+	fs_mounted = 1;
+	// First data entry can never be written (always FAT_EOC) in FAT.
+	num_avail_data_blks = superblock.amt_data_blks - 1;
+	next_free_hint = 1;
+	return 0;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_with(diskname, NULL);
+}
+
+int fs_mount_with(const char *diskname, const struct fs_mount_options *options)
+{
+	static const struct fs_mount_options default_options;
+	if (options == NULL) {
+		options = &default_options;
+	}
+	if (options->cache_policy != FS_CACHE_LRU && options->cache_policy != FS_CACHE_2Q) {
+		return -1;
+	}
+
+	if (options->ram_disk ? block_disk_open_mem(diskname, !options->regular_pages) : block_disk_open(diskname)) {
+		return -1;
+	}
+
+	return mount_disk(options);
+}
+
+int fs_mount_overlay(const char *basename, const char *deltaname)
+{
+	static const struct fs_mount_options default_options;
+
+	// Past this point, the overlay looks like any other writable disk.
+	if (block_disk_open_overlay(basename, deltaname)) {
+		return -1;
+	}
+
+	return mount_disk(&default_options);
+}
+
+int fs_get_cache_stats(struct fs_cache_stats *stats)
+{
+	if (!fs_mounted || fs_read_only || stats == NULL) {
+		return -1;
+	}
+
+	struct cache_stats counters;
+	if (cache_get_stats(&counters)) {
+		return -1;
+	}
+
+	stats->policy = cache_policy;
+	stats->hits = counters.hits;
+	stats->misses = counters.misses;
+	stats->evictions = counters.evictions;
+	return 0;
+}
+
+// Uncompressed size of chunk @c of the packed file described by @entry.
+static size_t pack_chunk_size(const struct pack_dir_entry *entry, size_t c)
+{
+	size_t size = entry->size_file - c * PACK_CHUNK_SIZE;
+	return size < PACK_CHUNK_SIZE ? size : PACK_CHUNK_SIZE;
+}
+
+// Check the packed image mapped at ro_image, then set it up as the mounted file system. Everything a read relies on is checked here, so that reads can trust the image.
+static int pack_mount(void)
+{
+	size_t image_size = (size_t)block_disk_count() * BLOCK_SIZE;
+	const struct pack_header *header = (const struct pack_header*)ro_image;
+	if (header->num_files > FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	size_t chunks_offset = sizeof(struct pack_header) + header->num_files * sizeof(struct pack_dir_entry);
+	size_t data_offset = chunks_offset + ((size_t)header->num_chunks + 1) * sizeof(uint64_t);
+	if (data_offset > image_size) {
+		return -1;
+	}
+
+	const struct pack_dir_entry *directory = (const struct pack_dir_entry*)(ro_image + sizeof(struct pack_header));
+	const uint64_t *chunks = (const uint64_t*)(ro_image + chunks_offset);
+	if (chunks[0] < data_offset || chunks[header->num_chunks] > image_size) {
+		return -1;
+	}
+	for (uint32_t c = 0; c < header->num_chunks; c++) {
+		if (chunks[c] > chunks[c + 1]) {
+			return -1;
+		}
+	}
+
+	for (uint32_t x = 0; x < header->num_files; x++) {
+		// Names must be terminated, and sorted for lookups.
+		if (directory[x].filename[0] == '\0' || memchr(directory[x].filename, '\0', FS_FILENAME_LEN) == NULL
+		    || (x > 0 && strcmp(directory[x - 1].filename, directory[x].filename) >= 0)) {
+			return -1;
+		}
+
+		size_t num_chunks = (directory[x].size_file + PACK_CHUNK_SIZE - 1) / PACK_CHUNK_SIZE;
+		if (directory[x].idx_first_chunk + num_chunks > header->num_chunks) {
+			return -1;
+		}
+		for (size_t c = 0; c < num_chunks; c++) {
+			size_t idx = directory[x].idx_first_chunk + c;
+			if (chunks[idx + 1] - chunks[idx] > pack_chunk_size(&directory[x], c)) {
+				return -1;
+			}
+		}
+	}
+
+	// There are no data blocks to point to.
+	for (uint32_t x = 0; x < header->num_files; x++) {
+		memcpy(rw_root_directory[x].filename, directory[x].filename, FS_FILENAME_LEN);
+		rw_root_directory[x].size_file = directory[x].size_file;
+		rw_root_directory[x].idx_first_data_blk = FAT_EOC;
+	}
+
+	pack_image = header;
+	pack_directory = directory;
+	pack_chunks = chunks;
+	pack_generation++;
+	return 0;
+}
+
+int fs_mount_ro(const char *diskname)
+{
+	if (block_disk_open_ro(diskname)) {
+		return -1;
+	}
+
+	// Nothing is read nor allocated: metadata is used in place, from pages shared by every process that mounts the same image.
+	ro_image = block_disk_map();
+	if (ro_image == NULL) {
+		block_disk_close();
+		return -1;
+	}
+
+	if (!memcmp(ro_image, PACK_SIG, SIG_LEN)) {
+		if (pack_mount()) {
+			ro_image = NULL;
+			block_disk_close();
+			return -1;
 		}
 	} else {
-		return 0;
+		memcpy(&superblock, ro_image, BLOCK_SIZE);
+
+		// Same checks as fs_mount(), plus making sure metadata lies within the mapping since it is used in place.
+		if (memcmp(superblock.signature, specified_signature, SIG_LEN) || superblock.tot_amt_blks != block_disk_count()
+		    || superblock.root_dir_blk_idx >= superblock.tot_amt_blks || superblock.num_blks_fat >= superblock.root_dir_blk_idx
+		    || superblock.data_blk_start_idx + superblock.amt_data_blks > superblock.tot_amt_blks) {
+			superblock = clean_superblock;
+			ro_image = NULL;
+			block_disk_close();
+			return -1;
+		}
+
+		for (int i = 0; i < superblock.num_blks_fat; i++) {
+			ro_fat[i] = (const struct fat_block*)(ro_image + (1 + i) * BLOCK_SIZE);
+		}
+		// The mapping is read-only, but mutating calls are rejected before they could touch it.
+		root_directory = (struct root_dir_entry*)(ro_image + superblock.root_dir_blk_idx * BLOCK_SIZE);
 	}
 
-	uint8_t file_blocks_array[counter * BLOCK_SIZE];
-	int k = 0;
-	while (file_blocks[k] != FAT_EOC) {
-		block_read(file_blocks[k], &file_blocks_array[k*BLOCK_SIZE]);
-		k++;
+	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+		FD[j] = empty_FD;
 	}
 
-	size_t actual_count = count;
-	if (count > root_directory[x].size_file - FD[i].file_offset) {
-		actual_count = root_directory[x].size_file - FD[i].file_offset;
+	fs_mounted = 1;
+	fs_read_only = 1;
+	return 0;
+}
+
+// Build the extent map of file @x from its FAT chain. A chain longer than the data region loops, so it is cut there.
+static int extent_map_build(int x)
+{
+	struct extent_map *map = &extent_maps[x];
+	map->generation = 0;
+	map->num_extents = 0;
+	map->num_blks = 0;
+
+	for (uint16_t cur = root_directory[x].idx_first_data_blk; cur != FAT_EOC && map->num_blks < superblock.amt_data_blks; cur = fat_get(cur)) {
+		struct extent *last = map->num_extents > 0 ? &map->extents[map->num_extents - 1] : NULL;
+		if (last != NULL && last->physical + last->length == cur && last->length < UINT16_MAX) {
+			last->length++;
+		} else {
+			if (map->num_extents == map->max_extents) {
+				size_t max_extents = map->max_extents > 0 ? 2 * map->max_extents : 8;
+				struct extent *extents = realloc(map->extents, max_extents * sizeof(struct extent));
+				if (extents == NULL) {
+					return -1;
+				}
+				map->extents = extents;
+				map->max_extents = max_extents;
+			}
+			struct extent extent = { .logical = map->num_blks, .physical = cur, .length = 1 };
+			map->extents[map->num_extents++] = extent;
+		}
+		map->num_blks++;
+	}
+
+	map->generation = fat_generation;
+	map->idx_first_data_blk = root_directory[x].idx_first_data_blk;
+	return 0;
+}
+
+// Whether file @x has an extent map matching its chain.
+static int extent_map_valid(int x)
+{
+	return extent_maps[x].generation == fat_generation && extent_maps[x].idx_first_data_blk == root_directory[x].idx_first_data_blk;
+}
+
+static void extent_map_destroy(void)
+{
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		free(extent_maps[x].extents);
+		extent_maps[x] = (struct extent_map){ 0 };
+	}
+}
+
+// Find data block @blk of file @x, and set @prev to the block before it in the chain, or FAT_EOC for the first one. Past the end of the chain, return FAT_EOC and set @prev to its last block. Looks the block up in the file's extent map, built on the spot on a read-write mount. Readers of a read-only mount only share maps built by fs_open(), and walk the chain without one.
+static uint16_t file_seek(int x, size_t blk, uint16_t *prev)
+{
+	struct extent_map *map = &extent_maps[x];
+	if (!extent_map_valid(x) && (fs_read_only || extent_map_build(x))) {
+		*prev = FAT_EOC;
+		uint16_t cur = root_directory[x].idx_first_data_blk;
+		for (size_t skip = blk; skip > 0 && cur != FAT_EOC; skip--) {
+			*prev = cur;
+			cur = fat_get(cur);
+		}
+		return cur;
+	}
+
+	if (blk >= map->num_blks) {
+		*prev = FAT_EOC;
+		if (map->num_extents > 0) {
+			struct extent *last = &map->extents[map->num_extents - 1];
+			*prev = last->physical + last->length - 1;
+		}
+		return FAT_EOC;
+	}
+
+	// Last extent starting at or before the block.
+	size_t lo = 0;
+	size_t hi = map->num_extents;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (map->extents[mid].logical <= blk) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	struct extent *extent = &map->extents[lo];
+	uint16_t cur = extent->physical + (blk - extent->logical);
+	if (blk == 0) {
+		*prev = FAT_EOC;
+	} else if (blk > extent->logical) {
+		*prev = cur - 1;
+	} else {
+		*prev = map->extents[lo - 1].physical + map->extents[lo - 1].length - 1;
+	}
+	return cur;
+}
+
+int fs_umount(void)
+{
+	if (!fs_mounted || num_open_fds > 0) {
+		return -1;
+	}
+
+	// Dirty FAT blocks must reach the disk before it goes away. If they cannot, the file system stays mounted, so that unmounting can be retried.
+	if (!fs_read_only && metadata_flush()) {
+		return -1;
+	}
+	// A RAM disk that cannot be written back stays open, and so does the file system, so that unmounting can be retried.
+	if (block_disk_close()) {
+		return -1;
+	}
+
+	// Clean up our metadata blocks. The disk's mapping went away with it.
+	superblock = clean_superblock;
+	if (fs_read_only) {
+		ro_image = NULL;
+		root_directory = rw_root_directory;
+		pack_image = NULL;
+		pack_directory = NULL;
+		pack_chunks = NULL;
+	} else {
+		cache_destroy();
+	}
+	snap_frozen_loaded = 0;
+	cbt_loaded = 0;
+	dedup_loaded = 0;
+	memset(log_freed, 0, sizeof(log_freed));
+	log_num_freed = 0;
+	log_num_appended = 0;
+	log_need_clean = 0;
+	log_need_checkpoint = 0;
+	extent_map_destroy();
+	// We have to reset our root directory entry by entry, due to its implementation's static nature.
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		root_directory[i] = clean_root_dir_entry;
+	}
+
+	// Clean up our file descriptor table.
+	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+		FD[j] = empty_FD;
+	}
+
+	fs_mounted = 0;
+	fs_read_only = 0;
+	num_avail_data_blks = 0;
+	return 0;
+}
+
+int fs_info(void)
+{
+	if (block_disk_count() < 0) {
+		return -1;
+	}
+
+	fprintf(stdout, "FS Info:\n");
+	// A packed image has none of the regular layout.
+	if (pack_image != NULL) {
+		fprintf(stdout, "packed_blk_count=%d\n", block_disk_count());
+		fprintf(stdout, "chunk_count=%u\n", pack_image->num_chunks);
+		fprintf(stdout, "file_count=%u\n", pack_image->num_files);
+		return 0;
+	}
+	fprintf(stdout, "total_blk_count=%d\n", superblock.tot_amt_blks);
+	fprintf(stdout, "fat_blk_count=%d\n", superblock.num_blks_fat);
+	fprintf(stdout, "rdir_blk=%d\n", 1 + superblock.num_blks_fat);
+	fprintf(stdout, "data_blk=%d\n", 1 + superblock.num_blks_fat + 1);
+	fprintf(stdout, "data_blk_count=%d\n", superblock.amt_data_blks);
+
+	int num_free_data_blks = 0;
+	for (int i = 0; i < superblock.amt_data_blks; i++) {
+		if (fat_get(i) == 0) {
+			num_free_data_blks++;
+		}
+	}
+
+	fprintf(stdout, "fat_free_ratio=%d/%d\n", num_free_data_blks, superblock.amt_data_blks);
+
+	// Recycling this variable.
+	num_free_data_blks = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_directory[i].filename[0] == '\0') {
+			num_free_data_blks++;
+		}
+	}
+
+	fprintf(stdout, "rdir_free_ratio=%d/%d\n", num_free_data_blks, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+static int is_invalid_file(const char* filename) {
+	for (int i = 0; i <= FS_FILENAME_LEN; i++) {
+		if (i == FS_FILENAME_LEN) {
+			return 1;
+		}
+
+		if (filename[i] == '\0') {
+			return 0;
+		}
+	}
+
+	// We should never get here.
+	return -1;
+}
+
+int fs_create(const char *filename)
+{
+	if (!fs_mounted || fs_read_only || num_files_root_dir >= FS_FILE_MAX_COUNT || is_invalid_file(filename)) {
+		return -1;
+	}
+
+	// Find the file in the root directory.
+	int x;
+	for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (!strcmp(filename, root_directory[x].filename)) {
+			break;
+		}
+	}
+
+	// The file already exists.
+	if (x < FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	int entry = 0;
+	while (entry < FS_FILE_MAX_COUNT) {
+		// Find the first empty entry in the root directory.
+		if (root_directory[entry].filename[0] == '\0') {
+			break;
+		}
+
+		entry++;
+	}
+
+	// Fill it in.
+	int i;
+	for (i = 0; i < (int)strlen(filename); i++) {
+		root_directory[entry].filename[i] = filename[i];
+	}
+	root_directory[entry].filename[i] = '\0';
+	root_directory[entry].size_file = 0;
+	root_directory[entry].idx_first_data_blk = FAT_EOC;
+	root_directory[entry].ring_num_blks = 0;
+	root_directory[entry].ring_start = 0;
+	num_files_root_dir++;
+
+	// Update disk.
+	return metadata_flush();
+}
+
+int fs_create_ring(const char *filename, size_t capacity)
+{
+	size_t num_blks = (capacity + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blks == 0 || num_blks > UINT16_MAX || fs_create(filename)) {
+		return -1;
+	}
+
+	int x;
+	for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (!strcmp(filename, root_directory[x].filename)) {
+			break;
+		}
+	}
+
+	// Every block the file will ever use is allocated now, so writing to it never allocates.
+	uint16_t prev = FAT_EOC;
+	for (size_t n = 0; n < num_blks; n++) {
+		uint16_t cur = fat_alloc();
+		if (cur == FAT_EOC) {
+			chain_free(root_directory[x].idx_first_data_blk);
+			root_directory[x].idx_first_data_blk = FAT_EOC;
+			fs_delete(filename);
+			return -1;
+		}
+
+		if (prev == FAT_EOC) {
+			root_directory[x].idx_first_data_blk = cur;
+		} else {
+			fat_set(prev, cur);
+		}
+		prev = cur;
+	}
+	root_directory[x].ring_num_blks = num_blks;
+
+	return metadata_flush();
+}
+
+int fs_delete(const char *filename)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(filename)) {
+		return -1;
+	}
+
+	int x;
+	for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (!strcmp(filename, root_directory[x].filename)) {
+			break;
+		}
+	}
+
+	// The file does not exist in the file system.
+	if (x >= FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	// The file is currently open.
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (FD[i].idx_file_root_dir == x) {
+			return -1;
+		}
+	}
+
+	// No need to free space for empty files. A chain shared with other files stays theirs.
+	struct dedup_entry *shared = dedup_find(root_directory[x].idx_first_data_blk);
+	if (shared != NULL) {
+		shared->refcount--;
+		dedup_dirty = 1;
+	}
+	if (shared == NULL || shared->refcount == 0) {
+		chain_free(root_directory[x].idx_first_data_blk);
+	}
+
+	// Empty the entry in the root directory.
+	root_directory[x].filename[0] = '\0';
+	root_directory[x].size_file = 0;
+	root_directory[x].idx_first_data_blk = FAT_EOC;
+	root_directory[x].ring_num_blks = 0;
+	root_directory[x].ring_start = 0;
+
+	// Write all potentially modified data back to disk.
+	return metadata_flush();
+}
+
+int fs_ls(void)
+{
+	if (!fs_mounted) {
+		return -1;
+	}
+
+	fprintf(stdout, "FS Ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_directory[i].filename[0] != '\0') {
+			fprintf(stdout, "file: %s, size: %d, data_blk: %d\n", root_directory[i].filename, root_directory[i].size_file, root_directory[i].idx_first_data_blk);
+		}
+	}
+
+	return 0;
+}
+
+int fs_block_owner(size_t block, char *filename)
+{
+	if (!fs_mounted || filename == NULL || block >= superblock.tot_amt_blks) {
+		return -1;
+	}
+
+	// Superblock, FAT and root directory.
+	if (block < superblock.data_blk_start_idx) {
+		return 1;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_directory[i].filename[0] == '\0') {
+			continue;
+		}
+
+		uint16_t entry = root_directory[i].idx_first_data_blk;
+		while (entry != FAT_EOC) {
+			if (superblock.data_blk_start_idx + entry == block) {
+				memcpy(filename, root_directory[i].filename, FS_FILENAME_LEN);
+				return 0;
+			}
+			entry = fat_get(entry);
+		}
+	}
+
+	// Free, or used internally (snapshots, checkpoints).
+	return 2;
+}
+
+int fs_block_owners(int *owners, size_t num_blks, char names[][FS_FILENAME_LEN])
+{
+	if (!fs_mounted || owners == NULL || names == NULL) {
+		return -1;
+	}
+
+	for (size_t b = 0; b < num_blks; b++) {
+		owners[b] = b < superblock.data_blk_start_idx ? FS_OWNER_METADATA : FS_OWNER_NONE;
+	}
+
+	// Blocks shared by deduplicated files go to the first of them, as with fs_block_owner(). A chain longer than the data region loops, so it is cut there.
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		memcpy(names[i], root_directory[i].filename, FS_FILENAME_LEN);
+		if (root_directory[i].filename[0] == '\0') {
+			continue;
+		}
+
+		uint16_t entry = root_directory[i].idx_first_data_blk;
+		for (size_t n = 0; entry != FAT_EOC && n < superblock.amt_data_blks; n++) {
+			size_t block = superblock.data_blk_start_idx + entry;
+			if (block < num_blks && owners[block] == FS_OWNER_NONE) {
+				owners[block] = i;
+			}
+			entry = fat_get(entry);
+		}
+	}
+
+	return 0;
+}
+
+static int pack_compare_name(const void *key, const void *entry)
+{
+	return strncmp(key, ((const struct root_dir_entry*)entry)->filename, FS_FILENAME_LEN);
+}
+
+// Index of open file descriptor @fd in the FD table, or -1. Descriptors are handed out as their index plus one, so there is nothing to scan.
+static int fd_find(int fd)
+{
+	if (fd < 1 || fd > FS_OPEN_MAX_COUNT || FD[fd - 1].file_descriptor != fd) {
+		return -1;
+	}
+
+	return fd - 1;
+}
+
+int fs_open(const char *filename)
+{
+	if (!fs_mounted || num_open_fds >= FS_OPEN_MAX_COUNT || is_invalid_file(filename)) {
+		return -1;
+	}
+
+	int i;
+	if (pack_image != NULL) {
+		// A packed directory is sorted, and has no empty entries.
+		const struct root_dir_entry *entry = bsearch(filename, root_directory, pack_image->num_files, sizeof(struct root_dir_entry), pack_compare_name);
+		i = entry != NULL ? entry - root_directory : FS_FILE_MAX_COUNT;
+	} else {
+		for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (!strcmp(filename, root_directory[i].filename)) {
+				break;
+			}
+		}
+	}
+
+	if (i >= FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	int fd_idx = 0;
+	// This file descriptor is already open.
+	while (FD[fd_idx].file_descriptor != 0) {
+		fd_idx++;
+	}
+
+	FD[fd_idx].file_descriptor = fd_idx + 1;
+	// Redundant, but for readability.
+	FD[fd_idx].file_offset = 0;
+	FD[fd_idx].idx_file_root_dir = i;
+	FD[fd_idx].modified = 0;
+	FD[fd_idx].append = 0;
+	FD[fd_idx].tail.generation = 0;
+	FD[fd_idx].advice = FS_FADV_NORMAL;
+
+	// Readers may seek concurrently, so they need the map up front.
+	if (fs_read_only && pack_image == NULL && !extent_map_valid(i)) {
+		extent_map_build(i);
+	}
+
+	num_open_fds++;
+
+	return FD[fd_idx].file_descriptor;
+}
+
+int fs_open_append(const char *filename)
+{
+	if (fs_read_only) {
+		return -1;
+	}
+
+	int fd = fs_open(filename);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int i = fd_find(fd);
+	FD[i].append = 1;
+	FD[i].file_offset = root_directory[FD[i].idx_file_root_dir].size_file;
+
+	return fd;
+}
+
+int fs_close(int fd)
+{
+	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT) {
+		return -1;
+	}
+	
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	// Written content may now be shared with identical files.
+	if (FD[i].modified && superblock.idx_dedup_blk != 0) {
+		dedup_file(FD[i].idx_file_root_dir);
+	}
+	// The descriptor is closed all the same if the metadata cannot be written: it stays dirty, and goes with the next flush.
+	int ret = 0;
+	if (FD[i].modified && (superblock.idx_dedup_blk != 0 || superblock.log_head != 0 || FD[i].append)) {
+		ret = metadata_flush();
+	}
+
+	// This is how we denote an unopened file descriptor.
+	FD[i].file_descriptor = 0;
+	FD[i].file_offset = 0;
+	FD[i].idx_file_root_dir = -1;
+	FD[i].modified = 0;
+	FD[i].append = 0;
+	FD[i].advice = FS_FADV_NORMAL;
+
+	num_open_fds--;
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT) {
+		return -1;
+	}
+	
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	return root_directory[FD[i].idx_file_root_dir].size_file;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	if (!fs_mounted) {
+		return -1;
+	}
+
+	int i = fd_find(fd);
+	if (i < 0 || offset > root_directory[FD[i].idx_file_root_dir].size_file) {
+		return -1;
+	}
+
+	FD[i].file_offset = offset;
+
+	return 0;
+}
+
+// Write @count bytes from @buf to the chain of file @x, starting at byte @offset of the chain, and extend the chain as needed. The file's size is left to the caller. If @tail is not NULL and still holds the block the offset lies in or follows, the chain is not searched, and it is updated to the last block written. Returns the number of bytes written, fewer than @count if the disk is full.
+static size_t file_write(int x, size_t offset, const void *buf, size_t count, struct file_tail *tail)
+{
+	uint8_t bounce[BLOCK_SIZE];
+
+	size_t idx_blk = offset / BLOCK_SIZE;
+	int tail_valid = tail != NULL && tail->generation == fat_generation && tail->idx_first_data_blk == root_directory[x].idx_first_data_blk;
+	uint16_t prev;
+	uint16_t cur;
+	if (tail_valid && tail->idx_blk == idx_blk) {
+		prev = tail->prev;
+		cur = tail->blk;
+	} else if (tail_valid && tail->idx_blk + 1 == idx_blk) {
+		prev = tail->blk;
+		cur = fat_get(tail->blk);
+	} else {
+		cur = file_seek(x, idx_blk, &prev);
+	}
+	uint16_t before_prev = FAT_EOC;
+
+	size_t written = 0;
+	while (written < count) {
+		size_t blk_offset = (offset + written) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - blk_offset;
+		if (chunk > count - written) {
+			chunk = count - written;
+		}
+
+		// We are past the end of the file's chain, so extend it by one block.
+		int fresh = 0;
+		if (cur == FAT_EOC) {
+			cur = fat_alloc();
+			// If no more data blocks to spare, stop writing.
+			if (cur == FAT_EOC) {
+				break;
+			}
+
+			if (prev == FAT_EOC) {
+				root_directory[x].idx_first_data_blk = cur;
+			} else {
+				fat_set(prev, cur);
+			}
+			fresh = 1;
+		}
+
+		// A block shared with a snapshot is never modified in place: the file gets its own copy, and the original is left to the snapshot. On a log-structured volume no block is: the new content goes to the head of the log.
+		size_t src_blk = superblock.data_blk_start_idx + cur;
+		if (!fresh && (snap_is_frozen(cur) || superblock.log_head != 0)) {
+			uint16_t copy = fat_alloc();
+			if (copy == FAT_EOC) {
+				break;
+			}
+
+			fat_set(copy, fat_get(cur));
+			if (prev == FAT_EOC) {
+				root_directory[x].idx_first_data_blk = copy;
+			} else {
+				fat_set(prev, copy);
+			}
+			if (snap_is_frozen(cur)) {
+				fat_set(cur, FAT_SNAP);
+			} else {
+				log_free(cur);
+			}
+			cur = copy;
+		}
+
+		size_t disk_blk = superblock.data_blk_start_idx + cur;
+		if (chunk == BLOCK_SIZE) {
+			tracked_write(disk_blk, (const uint8_t*)buf + written);
+		} else {
+			// Partial block: keep the bytes around the written range.
+			if (fresh) {
+				memset(bounce, 0, BLOCK_SIZE);
+			} else {
+				block_read(src_blk, bounce);
+			}
+			memcpy(&bounce[blk_offset], (const uint8_t*)buf + written, chunk);
+			tracked_write(disk_blk, bounce);
+		}
+
+		written += chunk;
+		before_prev = prev;
+		prev = cur;
+		cur = fat_get(cur);
+	}
+
+	if (tail != NULL && written > 0) {
+		tail->generation = fat_generation;
+		tail->idx_first_data_blk = root_directory[x].idx_first_data_blk;
+		tail->idx_blk = (offset + written - 1) / BLOCK_SIZE;
+		tail->blk = prev;
+		tail->prev = before_prev;
+	}
+
+	return written;
+}
+
+// Append @count bytes from @buf to ring file @x, overwriting its oldest bytes once it is full. Only the last bytes fit if @count exceeds its capacity. Its blocks are all allocated already, so unless they are shared with a snapshot or the volume is log-structured, the FAT is left alone.
+static size_t ring_write(int x, const uint8_t *buf, size_t count)
+{
+	size_t capacity = (size_t)root_directory[x].ring_num_blks * BLOCK_SIZE;
+	size_t num_dropped = 0;
+	if (count > capacity) {
+		num_dropped = count - capacity;
+		buf += num_dropped;
+		count = capacity;
+	}
+
+	size_t done = 0;
+	while (done < count) {
+		size_t tail = (root_directory[x].ring_start + root_directory[x].size_file) % capacity;
+		size_t chunk = capacity - tail;
+		if (chunk > count - done) {
+			chunk = count - done;
+		}
+
+		size_t written = file_write(x, tail, buf + done, chunk, NULL);
+		size_t size = root_directory[x].size_file + written;
+		if (size > capacity) {
+			root_directory[x].ring_start = (root_directory[x].ring_start + size - capacity) % capacity;
+			size = capacity;
+		}
+		root_directory[x].size_file = size;
+
+		done += written;
+		if (written < chunk) {
+			return done;
+		}
+	}
+
+	return num_dropped + done;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	// Error checking. 
+	if (!fs_mounted || fs_read_only || fd > FS_OPEN_MAX_COUNT || buf == NULL){
+		return -1;
+	}
+
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	int x = FD[i].idx_file_root_dir;
+	size_t offset = FD[i].append ? root_directory[x].size_file : FD[i].file_offset;
+
+	if (dedup_unshare(x)) {
+		return -1;
+	}
+	FD[i].modified = 1;
+
+	size_t written;
+	if (root_directory[x].ring_num_blks != 0) {
+		written = ring_write(x, buf, count);
+	} else {
+		written = file_write(x, offset, buf, count, FD[i].append ? &FD[i].tail : NULL);
+		if (offset + written > root_directory[x].size_file) {
+			root_directory[x].size_file = offset + written;
+		}
+	}
+	if (FD[i].append) {
+		FD[i].file_offset = root_directory[x].size_file;
+	}
+
+	// A log-structured volume only writes a checkpoint once a segment's worth of blocks was appended, once it needs the blocks freed before it, or when the file is closed. So does a file opened for appending, whose new size is only written when it is closed.
+	int ret = 0;
+	if ((superblock.log_head == 0 && !FD[i].append) || log_num_appended >= LOG_SEGMENT_BLKS || log_need_checkpoint) {
+		ret = metadata_flush();
+	}
+
+	// No block is held anymore, so they can be moved around.
+	if (log_need_clean) {
+		log_need_clean = 0;
+		log_replenish();
+	}
+
+	if (ret) {
+		return -1;
+	}
+	return written;
+}
+
+// Copy @count bytes of packed file @x starting at @offset into @buf, all of them lying within the file. Chunks are decompressed into a buffer of the calling thread, so it is safe to call concurrently.
+static size_t pack_read(int x, size_t offset, void *buf, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		size_t c = (offset + done) / PACK_CHUNK_SIZE;
+		size_t chunk_offset = (offset + done) % PACK_CHUNK_SIZE;
+		size_t size = pack_chunk_size(&pack_directory[x], c);
+		size_t chunk = size - chunk_offset;
+		if (chunk > count - done) {
+			chunk = count - done;
+		}
+
+		uint32_t idx = pack_directory[x].idx_first_chunk + c;
+		const uint8_t *src = ro_image + pack_chunks[idx];
+		size_t src_size = pack_chunks[idx + 1] - pack_chunks[idx];
+		if (src_size == size) {
+			memcpy((uint8_t*)buf + done, src + chunk_offset, chunk);
+		} else {
+			if (pack_last.generation != pack_generation || pack_last.idx_chunk != idx) {
+				uLongf out_size = size;
+				pack_last.generation = 0;
+				if (uncompress(pack_last.data, &out_size, src, src_size) != Z_OK || out_size != size) {
+					break;
+				}
+				pack_last.generation = pack_generation;
+				pack_last.idx_chunk = idx;
+			}
+			memcpy((uint8_t*)buf + done, &pack_last.data[chunk_offset], chunk);
+		}
+
+		done += chunk;
+	}
+
+	return done;
+}
+
+// Run of consecutive disk blocks read as a whole into its part of the buffer of a parallel read.
+struct read_run {
+	size_t disk_blk;
+	size_t num_blks;
+	uint8_t *buf;
+};
+
+// State of parallel_read() shared by the calling thread and the threads it starts.
+struct parallel_read_state {
+	pthread_mutex_t lock;
+	struct read_run *runs;
+	size_t num_runs;
+	// Next run to read.
+	size_t next_run;
+	int error;
+};
+
+// Read runs until there are none left or one of them could not be read.
+static void *parallel_reader(void *arg)
+{
+	struct parallel_read_state *state = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		if (state->error || state->next_run == state->num_runs) {
+			pthread_mutex_unlock(&state->lock);
+			return NULL;
+		}
+		struct read_run *run = &state->runs[state->next_run++];
+		pthread_mutex_unlock(&state->lock);
+
+		int ret = 0;
+		if (ro_image != NULL) {
+			memcpy(run->buf, ro_image + run->disk_blk * BLOCK_SIZE, run->num_blks * BLOCK_SIZE);
+		} else {
+			void *bufs[BLOCK_VEC_MAX];
+			for (size_t i = 0; i < run->num_blks; i++) {
+				bufs[i] = run->buf + i * BLOCK_SIZE;
+			}
+			ret = block_read_vec(run->disk_blk, run->num_blks, bufs);
+		}
+
+		if (ret) {
+			pthread_mutex_lock(&state->lock);
+			state->error = 1;
+			pthread_mutex_unlock(&state->lock);
+		}
+	}
+}
+
+// Read up to @num_blks whole blocks of a chain into @buf, starting with block @*cur, which is left at the block after the last one read. The chain is resolved into runs up front, so that the threads reading them never touch the FAT. Returns the number of bytes read, 0 if there is no memory for the runs, or -1 if one of them cannot be read.
+static ssize_t parallel_read(uint16_t *cur, uint8_t *buf, size_t num_blks)
+{
+	struct parallel_read_state state = { .runs = malloc(num_blks * sizeof(struct read_run)) };
+	if (state.runs == NULL) {
+		return 0;
+	}
+
+	size_t n = 0;
+	for (; n < num_blks && *cur != FAT_EOC; n++) {
+		struct read_run *last = state.num_runs > 0 ? &state.runs[state.num_runs - 1] : NULL;
+		size_t disk_blk = superblock.data_blk_start_idx + *cur;
+		if (last != NULL && last->disk_blk + last->num_blks == disk_blk && last->num_blks < BLOCK_VEC_MAX) {
+			last->num_blks++;
+		} else {
+			struct read_run run = { .disk_blk = disk_blk, .num_blks = 1, .buf = buf + n * BLOCK_SIZE };
+			state.runs[state.num_runs++] = run;
+		}
+		*cur = fat_get(*cur);
+	}
+
+	// The calling thread reads its share too, and all of them if no other thread can be started.
+	size_t num_threads = PARALLEL_READ_MAX_THREADS - 1;
+	if (num_threads > state.num_runs - 1) {
+		num_threads = state.num_runs - 1;
+	}
+	pthread_mutex_init(&state.lock, NULL);
+
+	pthread_t tids[PARALLEL_READ_MAX_THREADS];
+	size_t num_started = 0;
+	while (num_started < num_threads && !pthread_create(&tids[num_started], NULL, parallel_reader, &state)) {
+		num_started++;
+	}
+	parallel_reader(&state);
+	for (size_t i = 0; i < num_started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_mutex_destroy(&state.lock);
+	free(state.runs);
+	return state.error ? -1 : (ssize_t)(n * BLOCK_SIZE);
+}
+
+// Copy up to @count bytes of the chain of file @x starting at byte @offset of the chain into @buf. Only reads the FAT and the file's blocks, so it is safe to call concurrently on a read-only mount. Long runs of whole blocks are read by a pool of threads.
+static size_t chain_read(int x, size_t offset, void *buf, size_t count)
+{
+	// Skip the blocks before the offset without reading them.
+	uint16_t prev;
+	uint16_t cur = file_seek(x, offset / BLOCK_SIZE, &prev);
+
+	uint8_t bounce[BLOCK_SIZE];
+	int parallel = 1;
+	size_t done = 0;
+	while (done < count && cur != FAT_EOC) {
+		size_t blk_offset = (offset + done) % BLOCK_SIZE;
+		if (parallel && blk_offset == 0 && (count - done) / BLOCK_SIZE >= PARALLEL_READ_MIN_BLKS) {
+			ssize_t num_read = parallel_read(&cur, (uint8_t*)buf + done, (count - done) / BLOCK_SIZE);
+			if (num_read < 0) {
+				break;
+			}
+			// Without memory for the runs, read one block at a time.
+			parallel = num_read > 0;
+			done += num_read;
+			continue;
+		}
+
+		size_t chunk = BLOCK_SIZE - blk_offset;
+		if (chunk > count - done) {
+			chunk = count - done;
+		}
+
+		size_t disk_blk = superblock.data_blk_start_idx + cur;
+		if (ro_image != NULL) {
+			memcpy((uint8_t*)buf + done, ro_image + disk_blk * BLOCK_SIZE + blk_offset, chunk);
+		} else if (chunk == BLOCK_SIZE) {
+			block_read(disk_blk, (uint8_t*)buf + done);
+		} else {
+			block_read(disk_blk, bounce);
+			memcpy((uint8_t*)buf + done, &bounce[blk_offset], chunk);
+		}
+
+		done += chunk;
+		cur = fat_get(cur);
+	}
+
+	return done;
+}
+
+// Copy @count bytes of ring file @x starting at @offset into @buf, all of them lying within the file. Offsets count from the oldest byte, wrapping around the end of its blocks.
+static size_t ring_read(int x, size_t offset, uint8_t *buf, size_t count)
+{
+	size_t capacity = (size_t)root_directory[x].ring_num_blks * BLOCK_SIZE;
+	size_t done = 0;
+	while (done < count) {
+		size_t pos = (root_directory[x].ring_start + offset + done) % capacity;
+		size_t chunk = capacity - pos;
+		if (chunk > count - done) {
+			chunk = count - done;
+		}
+
+		size_t num_read = chain_read(x, pos, buf + done, chunk);
+		done += num_read;
+		if (num_read < chunk) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+// Copy up to @count bytes of file @x starting at @offset into @buf. Safe to call concurrently on a read-only mount.
+static size_t file_read(int x, size_t offset, void *buf, size_t count)
+{
+	if (offset >= root_directory[x].size_file) {
+		return 0;
+	}
+
+	size_t actual_count = count;
+	if (count > root_directory[x].size_file - offset) {
+		actual_count = root_directory[x].size_file - offset;
+	}
+
+	if (pack_image != NULL) {
+		return pack_read(x, offset, buf, actual_count);
+	}
+	if (root_directory[x].ring_num_blks != 0) {
+		return ring_read(x, offset, buf, actual_count);
+	}
+	return chain_read(x, offset, buf, actual_count);
+}
+
+// Pass @advice on for the blocks holding bytes @offset to @offset + @count - 1 of the chain of file @x, one run of consecutive blocks at a time.
+static void chain_advise(int x, size_t offset, size_t count, int advice)
+{
+	if (count == 0) {
+		return;
+	}
+
+	uint16_t prev;
+	uint16_t cur = file_seek(x, offset / BLOCK_SIZE, &prev);
+	size_t num_blks = (offset + count - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1;
+
+	size_t run_start = 0;
+	size_t run_len = 0;
+	for (size_t n = 0; n < num_blks && cur != FAT_EOC; n++) {
+		if (run_len > 0 && cur == run_start + run_len) {
+			run_len++;
+		} else {
+			if (run_len > 0) {
+				block_advise(superblock.data_blk_start_idx + run_start, run_len, advice);
+			}
+			run_start = cur;
+			run_len = 1;
+		}
+		cur = fat_get(cur);
+	}
+	if (run_len > 0) {
+		block_advise(superblock.data_blk_start_idx + run_start, run_len, advice);
+	}
+}
+
+// Pass @advice on for the image blocks holding the chunks of packed file @x that bytes @offset to @offset + @count - 1 lie in.
+static void pack_advise(int x, size_t offset, size_t count, int advice)
+{
+	if (count == 0) {
+		return;
+	}
+
+	uint32_t first = pack_directory[x].idx_first_chunk + offset / PACK_CHUNK_SIZE;
+	uint32_t last = pack_directory[x].idx_first_chunk + (offset + count - 1) / PACK_CHUNK_SIZE;
+	size_t start = pack_chunks[first] / BLOCK_SIZE;
+	size_t end = (pack_chunks[last + 1] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	block_advise(start, end - start, advice);
+}
+
+// Pass @advice on for the blocks holding bytes @offset to @offset + @count - 1 of file @x, as far as they lie within the file.
+static void file_advise(int x, size_t offset, size_t count, int advice)
+{
+	if (offset >= root_directory[x].size_file) {
+		return;
+	}
+	if (count > root_directory[x].size_file - offset) {
+		count = root_directory[x].size_file - offset;
+	}
+
+	if (pack_image != NULL) {
+		pack_advise(x, offset, count, advice);
+	} else if (root_directory[x].ring_num_blks != 0) {
+		// The range may wrap around the end of the ring's blocks.
+		size_t capacity = (size_t)root_directory[x].ring_num_blks * BLOCK_SIZE;
+		size_t pos = (root_directory[x].ring_start + offset) % capacity;
+		size_t first = capacity - pos < count ? capacity - pos : count;
+		chain_advise(x, pos, first, advice);
+		chain_advise(x, 0, count - first, advice);
+	} else {
+		chain_advise(x, offset, count, advice);
+	}
+}
+
+// Ask for the blocks ahead of a sequential reader of file descriptor @i, which just read @done bytes at @offset, once it gets within half a window of the blocks already asked for.
+static void fd_readahead(int i, size_t offset, size_t done)
+{
+	size_t end = offset + done;
+
+	// A reader that skipped past the window starts over with a small one.
+	if (offset > FD[i].readahead_end) {
+		FD[i].readahead_end = offset;
+		FD[i].readahead_blks = READAHEAD_MIN_BLKS;
+	}
+
+	size_t window = FD[i].readahead_blks * BLOCK_SIZE;
+	if (end + window / 2 < FD[i].readahead_end) {
+		return;
+	}
+
+	size_t start = end > FD[i].readahead_end ? end : FD[i].readahead_end;
+	file_advise(FD[i].idx_file_root_dir, start, window, BLOCK_ADV_WILLNEED);
+	FD[i].readahead_end = start + window;
+	if (FD[i].readahead_blks < READAHEAD_MAX_BLKS) {
+		FD[i].readahead_blks *= 2;
+	}
+}
+
+// Drop the blocks of file @x that a reader that will not come back went past, once it crosses into a new batch, having read @done bytes at @offset. The batch the reader stopped in is kept.
+static void fd_drop_behind(int x, size_t offset, size_t done)
+{
+	size_t batch = (size_t)DROP_BEHIND_BLKS * BLOCK_SIZE;
+	size_t end = (offset + done) / batch * batch;
+	if (end <= offset / batch * batch) {
+		return;
+	}
+
+	size_t start = end > 2 * batch ? end - 2 * batch : 0;
+	if (start > offset) {
+		start = offset / batch * batch;
+	}
+	file_advise(x, start, end - start, BLOCK_ADV_DONTNEED);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT || buf == NULL){
+		return -1;
+	}
+
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	size_t done = file_read(FD[i].idx_file_root_dir, FD[i].file_offset, buf, count);
+
+	if (FD[i].advice == FS_FADV_SEQUENTIAL) {
+		fd_readahead(i, FD[i].file_offset, done);
+	} else if (FD[i].advice == FS_FADV_NOREUSE) {
+		fd_drop_behind(FD[i].idx_file_root_dir, FD[i].file_offset, done);
+	}
+
+	FD[i].file_offset += done;
+	return done;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	if (!fs_mounted || fd > FS_OPEN_MAX_COUNT || buf == NULL){
+		return -1;
+	}
+
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	// The file offset is left alone, so several threads can share @fd. So is the readahead window.
+	size_t done = file_read(FD[i].idx_file_root_dir, offset, buf, count);
+
+	if (FD[i].advice == FS_FADV_NOREUSE) {
+		fd_drop_behind(FD[i].idx_file_root_dir, offset, done);
+	}
+
+	return done;
+}
+
+int fs_fadvise(int fd, size_t offset, size_t len, int advice)
+{
+	if (!fs_mounted || advice < FS_FADV_NORMAL || advice > FS_FADV_NOREUSE) {
+		return -1;
+	}
+
+	// This file descriptor is not open.
+	int i = fd_find(fd);
+	if (i < 0) {
+		return -1;
+	}
+
+	int x = FD[i].idx_file_root_dir;
+	if (len == 0) {
+		len = SIZE_MAX;
+	}
+
+	if (advice == FS_FADV_WILLNEED) {
+		file_advise(x, offset, len, BLOCK_ADV_WILLNEED);
+		return 0;
+	}
+	if (advice == FS_FADV_DONTNEED) {
+		file_advise(x, offset, len, BLOCK_ADV_DONTNEED);
+		return 0;
+	}
+
+	FD[i].advice = advice;
+	FD[i].readahead_end = 0;
+	FD[i].readahead_blks = READAHEAD_MIN_BLKS;
+
+	// Only a mapped image has a readahead policy per range.
+	if (ro_image != NULL && advice == FS_FADV_SEQUENTIAL) {
+		file_advise(x, offset, len, BLOCK_ADV_SEQUENTIAL);
+	} else if (ro_image != NULL && advice == FS_FADV_RANDOM) {
+		file_advise(x, offset, len, BLOCK_ADV_RANDOM);
+	} else if (ro_image != NULL && advice == FS_FADV_NORMAL) {
+		file_advise(x, offset, len, BLOCK_ADV_NORMAL);
+	}
+
+	return 0;
+}
+
+// Give back the first @num_meta blocks of the metadata chain @meta of a snapshot that could not be taken.
+static void snap_free_meta(const uint16_t *meta, int num_meta)
+{
+	for (int i = 0; i < num_meta; i++) {
+		fat_set(meta[i], 0);
+		num_avail_data_blks++;
+	}
+}
+
+int fs_snapshot(const char *name)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(name) || name[0] == '\0' || snap_find(name) >= 0) {
+		return -1;
+	}
+
+	int slot;
+	for (slot = 0; slot < FS_SNAPSHOT_MAX_COUNT; slot++) {
+		if (superblock.snapshots[slot].name[0] == '\0') {
+			break;
+		}
+	}
+
+	// The snapshot table is full.
+	if (slot == FS_SNAPSHOT_MAX_COUNT) {
+		return -1;
+	}
+
+	// Blocks frozen by older snapshots must be known before the new one adds its own.
+	if (!snap_frozen_loaded && snap_load_frozen()) {
+		return -1;
+	}
+
+	// Allocate a chain of data blocks to hold a copy of every FAT block and of the root directory.
+	int num_meta = superblock.num_blks_fat + 1;
+	uint16_t meta[num_meta];
+	for (int i = 0; i < num_meta; i++) {
+		meta[i] = fat_alloc();
+		if (meta[i] == FAT_EOC) {
+			// Not enough space: give back what was taken.
+			snap_free_meta(meta, i);
+			return -1;
+		}
+
+		if (i > 0) {
+			fat_set(meta[i - 1], meta[i]);
+		}
+	}
+
+	// The new chain holds saved metadata too.
+	snap_load_meta();
+	for (int i = 0; i < num_meta; i++) {
+		snap_meta[meta[i] / 8] |= 1 << (meta[i] % 8);
+	}
+
+	// Save the metadata as it is now. Only metadata is copied: data blocks become shared with the live file system. The saved FAT leaves out the blocks the snapshot does not share, so that deleting another snapshot releases them.
+	if (metadata_flush()) {
+		snap_free_meta(meta, num_meta);
+		return -1;
+	}
+	for (int i = 0; i < superblock.num_blks_fat; i++) {
+		struct fat_block *fat_blk = cache_get(1 + i);
+		if (fat_blk == NULL) {
+			snap_free_meta(meta, num_meta);
+			return -1;
+		}
+
+		struct fat_block saved = *fat_blk;
+		for (int k = 0; k < NUM_ENTRIES_FAT_BLK; k++) {
+			int idx = i * NUM_ENTRIES_FAT_BLK + k;
+			if (idx >= superblock.amt_data_blks || !snap_shares(idx, saved.next_data_blk[k])) {
+				saved.next_data_blk[k] = 0;
+			}
+		}
+		if (tracked_write(superblock.data_blk_start_idx + meta[i], &saved)) {
+			snap_free_meta(meta, num_meta);
+			return -1;
+		}
+	}
+	if (tracked_write(superblock.data_blk_start_idx + meta[num_meta - 1], root_directory)) {
+		snap_free_meta(meta, num_meta);
+		return -1;
+	}
+
+	// Every block of the live file system at this point is now shared with the snapshot.
+	for (int idx = 0; idx < superblock.amt_data_blks; idx++) {
+		if (snap_shares(idx, fat_get(idx))) {
+			snap_frozen[idx / 8] |= 1 << (idx % 8);
+		}
+	}
+
+	// Publish the snapshot once its content is safely on disk.
+	memset(superblock.snapshots[slot].name, 0, FS_FILENAME_LEN);
+	strcpy(superblock.snapshots[slot].name, name);
+	superblock.snapshots[slot].idx_first_meta_blk = meta[0];
+	return tracked_write(0, &superblock);
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(name)) {
+		return -1;
+	}
+
+	int slot = snap_find(name);
+	if (slot < 0) {
+		return -1;
+	}
+
+	uint16_t first_meta = superblock.snapshots[slot].idx_first_meta_blk;
+	superblock.snapshots[slot] = clean_superblock.snapshots[slot];
+	if (tracked_write(0, &superblock) || snap_load_frozen()) {
+		return -1;
+	}
+
+	// Release the saved metadata, then every block only this snapshot was holding on to.
+	uint16_t entry = first_meta;
+	while (entry != FAT_EOC) {
+		uint16_t next_location = fat_get(entry);
+		if (snap_is_frozen(entry)) {
+			fat_set(entry, FAT_SNAP);
+		} else {
+			fat_set(entry, 0);
+			num_avail_data_blks++;
+		}
+		entry = next_location;
+	}
+
+	for (int idx = 0; idx < superblock.amt_data_blks; idx++) {
+		if (fat_get(idx) == FAT_SNAP && !snap_is_frozen(idx)) {
+			fat_set(idx, 0);
+			num_avail_data_blks++;
+		}
+	}
+
+	return metadata_flush();
+}
+
+int fs_mount_snapshot(const char *diskname, const char *name)
+{
+	if (is_invalid_file(name) || fs_mount_ro(diskname)) {
+		return -1;
+	}
+
+	int slot = snap_find(name);
+	if (slot < 0) {
+		fs_umount();
+		return -1;
+	}
+
+	// Locate the saved metadata through the live FAT before switching over to it.
+	int num_meta = superblock.num_blks_fat + 1;
+	uint16_t meta[num_meta];
+	uint16_t cur = superblock.snapshots[slot].idx_first_meta_blk;
+	for (int i = 0; i < num_meta; i++) {
+		if (cur >= superblock.amt_data_blks) {
+			fs_umount();
+			return -1;
+		}
+		meta[i] = cur;
+		cur = fat_get(cur);
+	}
+
+	for (int i = 0; i < superblock.num_blks_fat; i++) {
+		ro_fat[i] = (const struct fat_block*)(ro_image + (superblock.data_blk_start_idx + meta[i]) * BLOCK_SIZE);
+	}
+	root_directory = (struct root_dir_entry*)(ro_image + (superblock.data_blk_start_idx + meta[num_meta - 1]) * BLOCK_SIZE);
+
+	return 0;
+}
+
+// Find the checkpoint named @name, or return -1.
+static int cbt_find(const char *name)
+{
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (superblock.checkpoints[i].name[0] != '\0' && !strncmp(name, superblock.checkpoints[i].name, FS_FILENAME_LEN)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int fs_checkpoint(const char *name)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(name) || name[0] == '\0') {
+		return -1;
+	}
+
+	if (!cbt_loaded && cbt_load()) {
+		return -1;
+	}
+
+	// An existing checkpoint is simply moved to the present.
+	int slot = cbt_find(name);
+	if (slot >= 0) {
+		memset(cbt_map[slot], 0, sizeof(cbt_map[slot]));
+		cbt_dirty[slot] = 1;
+		return metadata_flush();
+	}
+
+	for (slot = 0; slot < FS_CHECKPOINT_MAX_COUNT; slot++) {
+		if (superblock.checkpoints[slot].name[0] == '\0') {
+			break;
+		}
+	}
+
+	// The checkpoint table is full.
+	if (slot == FS_CHECKPOINT_MAX_COUNT) {
+		return -1;
+	}
+
+	// Allocate a chain of data blocks for the bitmap.
+	int num_map = cbt_num_blks();
+	uint16_t map[CBT_MAX_BLKS];
+	for (int i = 0; i < num_map; i++) {
+		map[i] = fat_alloc();
+		if (map[i] == FAT_EOC) {
+			for (int j = 0; j < i; j++) {
+				fat_set(map[j], 0);
+				num_avail_data_blks++;
+			}
+			return -1;
+		}
+
+		if (i > 0) {
+			fat_set(map[i - 1], map[i]);
+		}
+	}
+
+	memset(superblock.checkpoints[slot].name, 0, FS_FILENAME_LEN);
+	strcpy(superblock.checkpoints[slot].name, name);
+	superblock.checkpoints[slot].idx_first_map_blk = map[0];
+	if (tracked_write(0, &superblock)) {
+		return -1;
+	}
+
+	// Changes made so far, including the bitmap's allocation, predate the checkpoint.
+	memset(cbt_map[slot], 0, sizeof(cbt_map[slot]));
+	cbt_dirty[slot] = 1;
+	return metadata_flush();
+}
+
+int fs_checkpoint_delete(const char *name)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(name)) {
+		return -1;
+	}
+
+	int slot = cbt_find(name);
+	if (slot < 0) {
+		return -1;
+	}
+
+	uint16_t entry = superblock.checkpoints[slot].idx_first_map_blk;
+	superblock.checkpoints[slot] = clean_superblock.checkpoints[slot];
+	cbt_dirty[slot] = 0;
+	if (tracked_write(0, &superblock)) {
+		return -1;
+	}
+
+	while (entry != FAT_EOC) {
+		uint16_t next_location = fat_get(entry);
+		fat_set(entry, 0);
+		num_avail_data_blks++;
+		entry = next_location;
+	}
+
+	return metadata_flush();
+}
+
+int fs_export_changes(const char *name, const char *filename)
+{
+	if (!fs_mounted || fs_read_only || is_invalid_file(name) || filename == NULL) {
+		return -1;
+	}
+
+	int slot = cbt_find(name);
+	// What is on disk must be up to date before being copied.
+	if (slot < 0 || (!cbt_loaded && cbt_load()) || metadata_flush()) {
+		return -1;
+	}
+
+	FILE *changes = fopen(filename, "w");
+	if (changes == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	struct changes_header header = {
+		.tot_amt_blks = superblock.tot_amt_blks,
+		.num_blks = 0
+	};
+	memcpy(header.signature, CHANGES_SIG, SIG_LEN);
+	for (int i = 0; i < superblock.tot_amt_blks; i++) {
+		if (cbt_map[slot][i / 8] & (1 << (i % 8))) {
+			header.num_blks++;
+		}
+	}
+
+	int ret = fwrite(&header, sizeof(header), 1, changes) == 1 ? 0 : -1;
+	uint8_t blk[BLOCK_SIZE];
+	for (uint32_t i = 0; i < superblock.tot_amt_blks && ret == 0; i++) {
+		if (!(cbt_map[slot][i / 8] & (1 << (i % 8)))) {
+			continue;
+		}
+
+		if (block_read(i, blk) || fwrite(&i, sizeof(i), 1, changes) != 1 || fwrite(blk, BLOCK_SIZE, 1, changes) != 1) {
+			ret = -1;
+		}
+	}
+
+	if (fclose(changes) || ret) {
+		return -1;
+	}
+
+	return header.num_blks;
+}
+
+int fs_apply_changes(const char *diskname, const char *filename)
+{
+	// Changes are applied to the raw disk, under the feet of no one.
+	if (fs_mounted || filename == NULL) {
+		return -1;
+	}
+
+	FILE *changes = fopen(filename, "r");
+	if (changes == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	struct changes_header header;
+	if (fread(&header, sizeof(header), 1, changes) != 1 || memcmp(header.signature, CHANGES_SIG, SIG_LEN)) {
+		fclose(changes);
+		return -1;
+	}
+
+	if (block_disk_open(diskname)) {
+		fclose(changes);
+		return -1;
+	}
+
+	// Both images must share the same geometry.
+	int ret = header.tot_amt_blks == (uint32_t)block_disk_count() ? 0 : -1;
+	uint8_t blk[BLOCK_SIZE];
+	for (uint32_t n = 0; n < header.num_blks && ret == 0; n++) {
+		uint32_t i;
+		if (fread(&i, sizeof(i), 1, changes) != 1 || fread(blk, BLOCK_SIZE, 1, changes) != 1 || block_write(i, blk)) {
+			ret = -1;
+		}
+	}
+
+	block_disk_close();
+	fclose(changes);
+
+	return ret ? -1 : (int)header.num_blks;
+}
+
+int fs_dedup(void)
+{
+	if (!fs_mounted || fs_read_only) {
+		return -1;
+	}
+
+	// The index must be on disk before the superblock refers to it.
+	if (superblock.idx_dedup_blk == 0) {
+		uint16_t idx = fat_alloc();
+		if (idx == FAT_EOC) {
+			return -1;
+		}
+
+		memset(&dedup_index, 0, sizeof(dedup_index));
+		superblock.idx_dedup_blk = idx;
+		dedup_loaded = 1;
+		dedup_dirty = 1;
+		if (metadata_flush() || tracked_write(0, &superblock)) {
+			return -1;
+		}
+	}
+
+	// Files written before deduplication was turned on.
+	int num_freed = 0;
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (root_directory[x].filename[0] == '\0') {
+			continue;
+		}
+
+		int ret = dedup_file(x);
+		if (ret < 0) {
+			return -1;
+		}
+		num_freed += ret;
+	}
+
+	return metadata_flush() ? -1 : num_freed;
+}
+
+int fs_clean(void)
+{
+	if (!fs_mounted || fs_read_only || superblock.log_head == 0 || metadata_flush()) {
+		return -1;
+	}
+
+	// Every cleaned segment fills at most one segment at the head of the log, so this ends.
+	int num_cleaned = 0;
+	for (size_t n = 0; n < log_num_segments(); n++) {
+		int ret = log_clean(LOG_SEGMENT_BLKS / 2);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		num_cleaned++;
+	}
+
+	return num_cleaned;
+}
+
+int fs_format(const char *diskname, size_t data_blk_count, const struct fs_format_options *options)
+{
+	static const struct fs_format_options default_options;
+	if (options == NULL) {
+		options = &default_options;
+	}
+
+	// The FAT needs one entry per data block. Every block index must fit in 16 bits, and the FAT's size in 8 bits.
+	size_t num_blks_fat = (data_blk_count + NUM_ENTRIES_FAT_BLK - 1) / NUM_ENTRIES_FAT_BLK + options->fat_reserve_blks;
+	size_t tot_amt_blks = 1 + num_blks_fat + 1 + data_blk_count;
+	if (fs_mounted || diskname == NULL || data_blk_count < 1 || data_blk_count > FS_DATA_BLK_MAX_COUNT || num_blks_fat > UINT8_MAX || tot_amt_blks > UINT16_MAX) {
+		return -1;
+	}
+
+	// Everything but the superblock and the first FAT entry is zero, so only those are written.
+	if (block_disk_create(diskname, tot_amt_blks, options->preallocate) || block_disk_open(diskname)) {
+		return -1;
+	}
+
+	struct superblock new_superblock = clean_superblock;
+	memcpy(new_superblock.signature, specified_signature, SIG_LEN);
+	new_superblock.tot_amt_blks = tot_amt_blks;
+	new_superblock.root_dir_blk_idx = 1 + num_blks_fat;
+	new_superblock.data_blk_start_idx = 1 + num_blks_fat + 1;
+	new_superblock.amt_data_blks = data_blk_count;
+	new_superblock.num_blks_fat = num_blks_fat;
+	if (options->log_structured) {
+		new_superblock.log_head = 1;
+	}
+
+	// First data entry can never be allocated.
+	struct fat_block first_fat_blk = { .next_data_blk = { FAT_EOC } };
+
+	int ret = 0;
+	if (block_write(0, &new_superblock) || block_write(1, &first_fat_blk)) {
+		ret = -1;
+	}
+
+	block_disk_close();
+	return ret;
+}
+
+// Copy @num_blks consecutive data blocks of the mounted read-only image, starting at @old_idx, to host file @fd laid out as @new_superblock, starting at @new_idx.
+static int compact_copy(int fd, const struct superblock *new_superblock, size_t old_idx, size_t new_idx, size_t num_blks)
+{
+	const uint8_t *src = ro_image + (superblock.data_blk_start_idx + old_idx) * BLOCK_SIZE;
+	off_t dst = (off_t)(new_superblock->data_blk_start_idx + new_idx) * BLOCK_SIZE;
+
+	return pwrite(fd, src, num_blks * BLOCK_SIZE, dst) == (ssize_t)(num_blks * BLOCK_SIZE) ? 0 : -1;
+}
+
+// Write the compacted copy of the mounted read-only image to host file @fd. @new_idx maps the data blocks of the image to their new index.
+static int compact_write(int fd, const struct superblock *new_superblock, const uint16_t *new_idx)
+{
+	struct fat_block *new_fat = calloc(new_superblock->num_blks_fat, BLOCK_SIZE);
+	struct root_dir_entry new_root_directory[FS_FILE_MAX_COUNT];
+	if (new_fat == NULL) {
+		return -1;
+	}
+	memcpy(new_root_directory, root_directory, BLOCK_SIZE);
+	new_fat[0].next_data_blk[0] = FAT_EOC;
+
+	int ret = ftruncate(fd, (off_t)new_superblock->tot_amt_blks * BLOCK_SIZE);
+	for (int x = 0; x < FS_FILE_MAX_COUNT && ret == 0; x++) {
+		if (root_directory[x].filename[0] == '\0') {
+			continue;
+		}
+
+		// A deduplicated chain is only copied once.
+		if (dedup_primary(x) >= 0) {
+			new_root_directory[x].idx_first_data_blk = new_idx[root_directory[x].idx_first_data_blk];
+			continue;
+		}
+
+		// Files are laid out one after the other, so each chain runs through consecutive blocks. Blocks that were already consecutive are copied with a single write.
+		uint16_t prev = FAT_EOC;
+		size_t run_start = 0;
+		size_t run_len = 0;
+		for (uint16_t cur = root_directory[x].idx_first_data_blk; cur != FAT_EOC; prev = cur, cur = fat_get(cur)) {
+			if (prev == FAT_EOC) {
+				new_root_directory[x].idx_first_data_blk = new_idx[cur];
+			} else {
+				new_fat[new_idx[prev] / NUM_ENTRIES_FAT_BLK].next_data_blk[new_idx[prev] % NUM_ENTRIES_FAT_BLK] = new_idx[cur];
+			}
+
+			if (run_len > 0 && cur != run_start + run_len) {
+				ret |= compact_copy(fd, new_superblock, run_start, new_idx[run_start], run_len);
+				run_len = 0;
+			}
+			if (run_len == 0) {
+				run_start = cur;
+			}
+			run_len++;
+		}
+
+		if (prev != FAT_EOC) {
+			ret |= compact_copy(fd, new_superblock, run_start, new_idx[run_start], run_len);
+			new_fat[new_idx[prev] / NUM_ENTRIES_FAT_BLK].next_data_blk[new_idx[prev] % NUM_ENTRIES_FAT_BLK] = FAT_EOC;
+		}
+	}
+
+	// The dedup index follows the files, and refers to their new chains.
+	if (superblock.idx_dedup_blk != 0) {
+		struct dedup_block new_dedup_index;
+		memcpy(&new_dedup_index, ro_image + (superblock.data_blk_start_idx + superblock.idx_dedup_blk) * BLOCK_SIZE, BLOCK_SIZE);
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (new_dedup_index.entries[i].refcount > 0) {
+				new_dedup_index.entries[i].idx_first_data_blk = new_idx[new_dedup_index.entries[i].idx_first_data_blk];
+			}
+		}
+
+		new_fat[new_superblock->idx_dedup_blk / NUM_ENTRIES_FAT_BLK].next_data_blk[new_superblock->idx_dedup_blk % NUM_ENTRIES_FAT_BLK] = FAT_EOC;
+		if (pwrite(fd, &new_dedup_index, BLOCK_SIZE, (off_t)(new_superblock->data_blk_start_idx + new_superblock->idx_dedup_blk) * BLOCK_SIZE) != BLOCK_SIZE) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && (pwrite(fd, new_superblock, BLOCK_SIZE, 0) != BLOCK_SIZE
+	    || pwrite(fd, new_fat, new_superblock->num_blks_fat * BLOCK_SIZE, BLOCK_SIZE) != (ssize_t)(new_superblock->num_blks_fat * BLOCK_SIZE)
+	    || pwrite(fd, new_root_directory, BLOCK_SIZE, (off_t)new_superblock->root_dir_blk_idx * BLOCK_SIZE) != BLOCK_SIZE || fsync(fd))) {
+		ret = -1;
+	}
+
+	free(new_fat);
+	return ret ? -1 : 0;
+}
+
+int fs_compact(const char *diskname)
+{
+	if (fs_mounted || diskname == NULL || fs_mount_ro(diskname)) {
+		return -1;
+	}
+
+	// Packed images are already as small as they get.
+	if (pack_image != NULL) {
+		fs_umount();
+		return -1;
+	}
+
+	// Snapshots and checkpoints refer to blocks by their index, which is about to change.
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (superblock.snapshots[i].name[0] != '\0') {
+			fs_umount();
+			return -1;
+		}
+	}
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (superblock.checkpoints[i].name[0] != '\0') {
+			fs_umount();
+			return -1;
+		}
+	}
+
+	// Number the blocks of every file in chain order, files one after the other. A chain that leaves the data region or loops is left to fs_check().
+	uint16_t *new_idx = calloc(UINT16_MAX + 1, sizeof(uint16_t));
+	if (new_idx == NULL) {
+		fs_umount();
+		return -1;
+	}
+
+	size_t num_used = 0;
+	int ret = 0;
+	for (int x = 0; x < FS_FILE_MAX_COUNT && ret == 0; x++) {
+		if (root_directory[x].filename[0] == '\0' || dedup_primary(x) >= 0) {
+			continue;
+		}
+
+		for (uint16_t cur = root_directory[x].idx_first_data_blk; cur != FAT_EOC && ret == 0; cur = fat_get(cur)) {
+			if (cur == 0 || cur >= superblock.amt_data_blks || new_idx[cur] != 0) {
+				ret = -1;
+			} else {
+				new_idx[cur] = ++num_used;
+			}
+		}
+	}
+
+	if (superblock.idx_dedup_blk != 0) {
+		new_idx[superblock.idx_dedup_blk] = ++num_used;
+	}
+
+	// Just enough data blocks for the files, after the first one that is never allocated.
+	struct superblock new_superblock = superblock;
+	new_superblock.idx_dedup_blk = new_idx[superblock.idx_dedup_blk];
+	new_superblock.amt_data_blks = 1 + num_used;
+	new_superblock.num_blks_fat = (new_superblock.amt_data_blks + NUM_ENTRIES_FAT_BLK - 1) / NUM_ENTRIES_FAT_BLK;
+	new_superblock.root_dir_blk_idx = 1 + new_superblock.num_blks_fat;
+	new_superblock.data_blk_start_idx = new_superblock.root_dir_blk_idx + 1;
+	new_superblock.tot_amt_blks = new_superblock.data_blk_start_idx + new_superblock.amt_data_blks;
+
+	// The compacted image replaces the original in one step, once it is entirely on disk.
+	char tmpname[PATH_MAX];
+	snprintf(tmpname, sizeof(tmpname), "%s.compact", diskname);
+	int fd = -1;
+	if (ret == 0) {
+		struct stat st;
+		fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || stat(diskname, &st) || fchmod(fd, st.st_mode & 07777) || compact_write(fd, &new_superblock, new_idx)) {
+			ret = -1;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	int num_freed = superblock.tot_amt_blks - new_superblock.tot_amt_blks;
+	free(new_idx);
+	fs_umount();
+
+	if (ret == 0 && rename(tmpname, diskname)) {
+		ret = -1;
+	}
+	if (ret && fd >= 0) {
+		unlink(tmpname);
+	}
+
+	return ret ? -1 : num_freed;
+}
+
+static int pack_compare_files(const void *a, const void *b)
+{
+	return strncmp(root_directory[*(const int*)a].filename, root_directory[*(const int*)b].filename, FS_FILENAME_LEN);
+}
+
+// Compress the content of every file but those sharing a deduplicated chain, chunk @first_chunk[x] onwards for file @x, and write the chunks to @fd from offset @offsets[0]. Fills in the offset of every following chunk.
+static int pack_write_chunks(int fd, const uint32_t *first_chunk, uint64_t *offsets)
+{
+	uint8_t *in = malloc(PACK_CHUNK_SIZE);
+	uLongf out_bound = compressBound(PACK_CHUNK_SIZE);
+	uint8_t *out = malloc(out_bound);
+	int ret = in != NULL && out != NULL ? 0 : -1;
+
+	for (int x = 0; x < FS_FILE_MAX_COUNT && ret == 0; x++) {
+		if (root_directory[x].filename[0] == '\0' || dedup_primary(x) >= 0) {
+			continue;
+		}
+
+		for (size_t offset = 0; offset < root_directory[x].size_file && ret == 0; offset += PACK_CHUNK_SIZE) {
+			size_t size = root_directory[x].size_file - offset;
+			if (size > PACK_CHUNK_SIZE) {
+				size = PACK_CHUNK_SIZE;
+			}
+			if (file_read(x, offset, in, size) != size) {
+				ret = -1;
+				break;
+			}
+
+			// Chunks that do not shrink are stored as is.
+			uLongf out_size = out_bound;
+			const uint8_t *src = out;
+			if (compress2(out, &out_size, in, size, Z_BEST_COMPRESSION) != Z_OK || out_size >= size) {
+				src = in;
+				out_size = size;
+			}
+
+			size_t idx = first_chunk[x] + offset / PACK_CHUNK_SIZE;
+			if (pwrite(fd, src, out_size, offsets[idx]) != (ssize_t)out_size) {
+				ret = -1;
+			}
+			offsets[idx + 1] = offsets[idx] + out_size;
+		}
+	}
+
+	free(in);
+	free(out);
+	return ret;
+}
+
+int fs_pack(const char *diskname, const char *packname)
+{
+	if (fs_mounted || diskname == NULL || packname == NULL || !strcmp(diskname, packname) || fs_mount_ro(diskname)) {
+		return -1;
+	}
+
+	if (pack_image != NULL) {
+		fs_umount();
+		return -1;
+	}
+
+	// Number the chunks of every file in root directory order. Files sharing a deduplicated chain share its chunks too.
+	int files[FS_FILE_MAX_COUNT];
+	uint32_t first_chunk[FS_FILE_MAX_COUNT];
+	int num_files = 0;
+	uint32_t num_chunks = 0;
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (root_directory[x].filename[0] == '\0') {
+			continue;
+		}
+
+		files[num_files++] = x;
+		int y = dedup_primary(x);
+		if (y >= 0) {
+			first_chunk[x] = first_chunk[y];
+		} else {
+			first_chunk[x] = num_chunks;
+			num_chunks += (root_directory[x].size_file + PACK_CHUNK_SIZE - 1) / PACK_CHUNK_SIZE;
+		}
+	}
+	qsort(files, num_files, sizeof(int), pack_compare_files);
+
+	struct pack_header header = { .num_files = num_files, .num_chunks = num_chunks };
+	memcpy(header.signature, PACK_SIG, SIG_LEN);
+
+	struct pack_dir_entry directory[FS_FILE_MAX_COUNT];
+	memset(directory, 0, sizeof(directory));
+	for (int f = 0; f < num_files; f++) {
+		memcpy(directory[f].filename, root_directory[files[f]].filename, FS_FILENAME_LEN);
+		directory[f].size_file = root_directory[files[f]].size_file;
+		directory[f].idx_first_chunk = first_chunk[files[f]];
+	}
+
+	size_t directory_size = num_files * sizeof(struct pack_dir_entry);
+	size_t offsets_size = (num_chunks + 1) * sizeof(uint64_t);
+	uint64_t *offsets = malloc(offsets_size);
+	int fd = open(packname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ret = offsets != NULL && fd >= 0 ? 0 : -1;
+
+	// The offset table is only known once every chunk is compressed. The image is then padded to whole blocks, as virtual disks are.
+	size_t num_blks = 0;
+	if (ret == 0) {
+		offsets[0] = sizeof(struct pack_header) + directory_size + offsets_size;
+		ret = pack_write_chunks(fd, first_chunk, offsets);
+	}
+	if (ret == 0) {
+		num_blks = (offsets[num_chunks] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+		    || pwrite(fd, directory, directory_size, sizeof(header)) != (ssize_t)directory_size
+		    || pwrite(fd, offsets, offsets_size, sizeof(header) + directory_size) != (ssize_t)offsets_size
+		    || ftruncate(fd, num_blks * BLOCK_SIZE) || fsync(fd)) {
+			ret = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (ret && fd >= 0) {
+		unlink(packname);
+	}
+	free(offsets);
+	fs_umount();
+
+	return ret ? -1 : (int)num_blks;
+}
+
+// Move every allocated data block @shift blocks further on the disk. Regions overlap, so runs are moved last ones first.
+static int grow_shift_data(size_t shift)
+{
+	uint8_t *buf = malloc(BLOCK_VEC_MAX * BLOCK_SIZE);
+	void *bufs[BLOCK_VEC_MAX];
+	if (buf == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < BLOCK_VEC_MAX; i++) {
+		bufs[i] = buf + i * BLOCK_SIZE;
+	}
+
+	int ret = 0;
+	size_t end = superblock.amt_data_blks;
+	while (end > 1 && ret == 0) {
+		if (fat_get(end - 1) == 0) {
+			end--;
+			continue;
+		}
+
+		size_t start = end - 1;
+		while (start > 1 && end - start < BLOCK_VEC_MAX && fat_get(start - 1) != 0) {
+			start--;
+		}
+
+		size_t disk_blk = superblock.data_blk_start_idx + start;
+		if (block_read_vec(disk_blk, end - start, bufs) || block_write_vec(disk_blk + shift, end - start, bufs)) {
+			ret = -1;
+		}
+		end = start;
+	}
+
+	free(buf);
+	return ret;
+}
+
+// Add blocks at the end of the changed-block bitmap of every checkpoint, which had @old_num_blks blocks before the disk grew.
+static int cbt_extend(int old_num_blks)
+{
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (superblock.checkpoints[i].name[0] == '\0') {
+			continue;
+		}
+
+		uint16_t last = superblock.checkpoints[i].idx_first_map_blk;
+		while (fat_get(last) != FAT_EOC) {
+			last = fat_get(last);
+		}
+
+		for (int j = old_num_blks; j < cbt_num_blks(); j++) {
+			uint16_t idx = fat_alloc();
+			if (idx == FAT_EOC) {
+				return -1;
+			}
+			fat_set(last, idx);
+			last = idx;
+		}
+
+		memset(&cbt_map[i][old_num_blks * BLOCK_SIZE], 0, (cbt_num_blks() - old_num_blks) * BLOCK_SIZE);
+		cbt_dirty[i] = 1;
+	}
+
+	return 0;
+}
+
+int fs_grow(size_t new_block_count)
+{
+	if (!fs_mounted || fs_read_only || new_block_count <= superblock.tot_amt_blks || new_block_count > UINT16_MAX) {
+		return -1;
+	}
+
+	// Reserved FAT blocks are used first. Beyond them, every added FAT block pushes the root directory and the data region one block further.
+	size_t num_blks_fat = superblock.num_blks_fat;
+	while (num_blks_fat * NUM_ENTRIES_FAT_BLK < new_block_count - superblock.data_blk_start_idx - (num_blks_fat - superblock.num_blks_fat)) {
+		num_blks_fat++;
+	}
+	size_t shift = num_blks_fat - superblock.num_blks_fat;
+	size_t data_blk_count = new_block_count - superblock.data_blk_start_idx - shift;
+	if (num_blks_fat > UINT8_MAX || data_blk_count > FS_DATA_BLK_MAX_COUNT) {
+		return -1;
+	}
+
+	// The metadata saved by a snapshot has one block per FAT block of the time, so the FAT cannot grow past them.
+	int num_checkpoints = 0;
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (shift > 0 && superblock.snapshots[i].name[0] != '\0') {
+			return -1;
+		}
+	}
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		num_checkpoints += superblock.checkpoints[i].name[0] != '\0';
+	}
+	if (num_checkpoints > 0 && !cbt_loaded && cbt_load()) {
+		return -1;
+	}
+
+	// Bitmaps that must grow with the disk take their new blocks from the added ones.
+	size_t num_new_cbt_blks = ((new_block_count + 7) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE - cbt_num_blks();
+	if (num_checkpoints * num_new_cbt_blks > data_blk_count - superblock.amt_data_blks) {
+		return -1;
+	}
+
+	// Everything cached must be on disk before blocks start moving under it.
+	int old_num_cbt_blks = cbt_num_blks();
+	uint16_t old_amt_data_blks = superblock.amt_data_blks;
+	if (metadata_flush() || block_disk_grow(new_block_count)) {
+		return -1;
+	}
+
+	if (shift > 0) {
+		if (grow_shift_data(shift)) {
+			return -1;
+		}
+
+		// New FAT blocks take the place of the old root directory and of the first data blocks, which were never allocated.
+		for (size_t blk = 1 + superblock.num_blks_fat; blk <= num_blks_fat; blk++) {
+			void *fat_blk = cache_get(blk);
+			if (fat_blk == NULL) {
+				return -1;
+			}
+			memset(fat_blk, 0, BLOCK_SIZE);
+			cache_mark_dirty(blk);
+		}
+	}
+
+	superblock.tot_amt_blks = new_block_count;
+	superblock.num_blks_fat = num_blks_fat;
+	superblock.root_dir_blk_idx = 1 + num_blks_fat;
+	superblock.data_blk_start_idx = superblock.root_dir_blk_idx + 1;
+	superblock.amt_data_blks = data_blk_count;
+	num_avail_data_blks += data_blk_count - old_amt_data_blks;
+
+	// Entries of reserved FAT blocks are normally zero already, but the new data blocks must start free.
+	for (size_t idx = old_amt_data_blks; idx < data_blk_count; idx++) {
+		if (fat_get(idx) != 0) {
+			fat_set(idx, 0);
+		}
+	}
+
+	// Bitmaps must cover the new blocks. Once data moved, every block differs from what a checkpoint saw.
+	if (num_checkpoints > 0 && cbt_extend(old_num_cbt_blks)) {
+		return -1;
+	}
+	for (size_t blk = 0; shift > 0 && num_checkpoints > 0 && blk < new_block_count; blk++) {
+		cbt_mark(blk);
+	}
+
+	// The superblock goes last, once the layout it describes is in place.
+	if (metadata_flush()) {
+		return -1;
+	}
+	return tracked_write(0, &superblock);
+}
+
+// Threads doing host I/O for fs_import() and fs_extract(), and chunks of file data in flight per thread.
+#define HOST_IO_MAX_THREADS 8
+#define HOST_IO_SLOTS_PER_THREAD 2
+
+// Number of threads to spread work over: one per online CPU, up to @max.
+static long num_worker_threads(long max)
+{
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1) {
+		return 1;
+	}
+
+	return num_threads < max ? num_threads : max;
+}
+
+// Run of consecutive disk blocks of one file, transferred between the disk and a host file as a whole.
+struct host_chunk {
+	int file;
+	// Offset of the run within the file.
+	size_t offset;
+	size_t disk_blk;
+	size_t num_blks;
+};
+
+// State of fs_import() shared by the host reading threads and the image writing thread.
+struct import_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const int *fds;
+	const size_t *sizes;
+	struct host_chunk *chunks;
+	size_t num_chunks;
+	// Next chunk to read from the host, and next chunk to write to the image.
+	size_t next_read;
+	size_t next_write;
+	// Chunk @c is read into slot @c % @num_slots, which is reused once it is written.
+	uint8_t *slots;
+	int *ready;
+	size_t num_slots;
+	int error;
+};
+
+// Read chunk @c of host data into @buf, padding the last block with zeros.
+static int import_read_chunk(struct import_state *state, size_t c, uint8_t *buf)
+{
+	struct host_chunk *chunk = &state->chunks[c];
+	size_t len = chunk->num_blks * BLOCK_SIZE;
+	if (len > state->sizes[chunk->file] - chunk->offset) {
+		len = state->sizes[chunk->file] - chunk->offset;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = pread(state->fds[chunk->file], buf + done, len - done, chunk->offset + done);
+		if (ret <= 0) {
+			return -1;
+		}
+		done += ret;
+	}
+	memset(buf + len, 0, chunk->num_blks * BLOCK_SIZE - len);
+
+	return 0;
+}
+
+static void *import_reader(void *arg)
+{
+	struct import_state *state = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->error && state->next_read < state->num_chunks && state->next_read >= state->next_write + state->num_slots) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->error || state->next_read == state->num_chunks) {
+			pthread_mutex_unlock(&state->lock);
+			return NULL;
+		}
+		size_t c = state->next_read++;
+		pthread_mutex_unlock(&state->lock);
+
+		int ret = import_read_chunk(state, c, state->slots + (c % state->num_slots) * BLOCK_VEC_MAX * BLOCK_SIZE);
+
+		pthread_mutex_lock(&state->lock);
+		if (ret) {
+			state->error = 1;
+		}
+		state->ready[c % state->num_slots] = 1;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+}
+
+// First run of @num_blks free data blocks, or 0 if there is none. Blocks freed since the last checkpoint are not free yet.
+static uint16_t import_find_run(size_t num_blks)
+{
+	size_t run = 0;
+
+	for (size_t idx = 1; idx < superblock.amt_data_blks; idx++) {
+		run = fat_get(idx) == 0 && !log_is_freed(idx) ? run + 1 : 0;
+		if (run == num_blks) {
+			return idx + 1 - num_blks;
+		}
+	}
+
+	return 0;
+}
+
+// Stream the host data of every chunk to the image, in layout order. Host files are read by a pool of threads while this one writes.
+static int import_stream(struct import_state *state)
+{
+	long num_threads = num_worker_threads(HOST_IO_MAX_THREADS);
+
+	state->num_slots = num_threads * HOST_IO_SLOTS_PER_THREAD;
+	state->slots = malloc(state->num_slots * BLOCK_VEC_MAX * BLOCK_SIZE);
+	state->ready = calloc(state->num_slots, sizeof(int));
+	if (state->slots == NULL || state->ready == NULL) {
+		free(state->slots);
+		free(state->ready);
+		return -1;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+
+	pthread_t tids[num_threads];
+	long num_started = 0;
+	while (num_started < num_threads && !pthread_create(&tids[num_started], NULL, import_reader, state)) {
+		num_started++;
+	}
+
+	for (size_t c = 0; c < state->num_chunks; c++) {
+		size_t slot = c % state->num_slots;
+		uint8_t *buf = state->slots + slot * BLOCK_VEC_MAX * BLOCK_SIZE;
+
+		// Without any reader thread, read each chunk right before writing it.
+		if (num_started == 0 && import_read_chunk(state, c, buf)) {
+			state->error = 1;
+			break;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		while (num_started > 0 && !state->error && !state->ready[slot]) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		int error = state->error;
+		pthread_mutex_unlock(&state->lock);
+		if (error) {
+			break;
+		}
+
+		struct host_chunk *chunk = &state->chunks[c];
+		size_t disk_blk = chunk->disk_blk;
+		void *bufs[BLOCK_VEC_MAX];
+		for (size_t i = 0; i < chunk->num_blks; i++) {
+			bufs[i] = buf + i * BLOCK_SIZE;
+			cbt_mark(disk_blk + i);
+		}
+		error = block_write_vec(disk_blk, chunk->num_blks, bufs);
+
+		pthread_mutex_lock(&state->lock);
+		if (error) {
+			state->error = 1;
+		}
+		state->ready[slot] = 0;
+		state->next_write = c + 1;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	for (long i = 0; i < num_started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	free(state->slots);
+	free(state->ready);
+	return state->error ? -1 : 0;
+}
+
+// Lay out @count files of @num_blks blocks each, back to back in a single run of free blocks if there is one, else in a run per file, else wherever there is room. A log-structured volume appends them to its log instead, like any other write. Chains are set up in the FAT as blocks are picked, and @layout receives every block in file order. If blocks run out, the ones picked are given back.
+static int import_allocate(const size_t *num_blks, int count, uint16_t *layout)
+{
+	size_t total = 0;
+	for (int f = 0; f < count; f++) {
+		total += num_blks[f];
+	}
+
+	int use_runs = superblock.log_head == 0;
+	uint16_t next = use_runs && total > 0 ? import_find_run(total) : 0;
+	size_t n = 0;
+	for (int f = 0; f < count; f++) {
+		if (num_blks[f] == 0) {
+			continue;
+		}
+
+		uint16_t run = next != 0 ? next : use_runs ? import_find_run(num_blks[f]) : 0;
+		for (size_t i = 0; i < num_blks[f]; i++) {
+			uint16_t idx;
+			if (run != 0) {
+				idx = run + i;
+				fat_set(idx, FAT_EOC);
+				num_avail_data_blks--;
+			} else {
+				idx = fat_alloc();
+				if (idx == FAT_EOC) {
+					for (size_t j = 0; j < n; j++) {
+						fat_set(layout[j], 0);
+					}
+					num_avail_data_blks += n;
+					return -1;
+				}
+			}
+			if (i > 0) {
+				fat_set(layout[n - 1], idx);
+			}
+			layout[n++] = idx;
+		}
+
+		if (next != 0) {
+			next += num_blks[f];
+		}
+	}
+
+	return 0;
+}
+
+// Import @count host files, opened as @fds, once it is known that there is room for them.
+static int import_files(const int *fds, const char *const *names, const size_t *sizes, const size_t *num_blks, int count, size_t total)
+{
+	struct import_state state = { .fds = fds, .sizes = sizes };
+
+	// Plan the whole layout up front, then cut it into runs of consecutive blocks within each file.
+	uint16_t *layout = malloc((total > 0 ? total : 1) * sizeof(uint16_t));
+	state.chunks = malloc((total > 0 ? total : 1) * sizeof(struct host_chunk));
+	if (layout == NULL || state.chunks == NULL) {
+		free(layout);
+		free(state.chunks);
+		return -1;
+	}
+	if (import_allocate(num_blks, count, layout)) {
+		free(layout);
+		free(state.chunks);
+		return -1;
+	}
+
+	size_t n = 0;
+	for (int f = 0; f < count; f++) {
+		for (size_t i = 0; i < num_blks[f]; i++, n++) {
+			// Extend the previous run of the file if this block follows it on disk.
+			if (i > 0 && state.chunks[state.num_chunks - 1].num_blks < BLOCK_VEC_MAX && layout[n] == layout[n - 1] + 1) {
+				state.chunks[state.num_chunks - 1].num_blks++;
+				continue;
+			}
+
+			struct host_chunk chunk = { .file = f, .offset = i * BLOCK_SIZE, .disk_blk = superblock.data_blk_start_idx + layout[n], .num_blks = 1 };
+			state.chunks[state.num_chunks++] = chunk;
+		}
+	}
+
+	if (import_stream(&state)) {
+		for (size_t i = 0; i < total; i++) {
+			fat_set(layout[i], 0);
+		}
+		num_avail_data_blks += total;
+		free(layout);
+		free(state.chunks);
+		return -1;
+	}
+
+	// Data is on disk, so the files can appear. All metadata leaves with a single flush.
+	n = 0;
+	for (int f = 0; f < count; f++) {
+		int x = 0;
+		while (root_directory[x].filename[0] != '\0') {
+			x++;
+		}
+
+		strcpy(root_directory[x].filename, names[f]);
+		root_directory[x].size_file = sizes[f];
+		root_directory[x].idx_first_data_blk = num_blks[f] > 0 ? layout[n] : FAT_EOC;
+		n += num_blks[f];
+		dedup_file(x);
+	}
+	num_files_root_dir += count;
+
+	free(layout);
+	free(state.chunks);
+	return metadata_flush();
+}
+
+int fs_import(const char *const paths[], int count)
+{
+	if (!fs_mounted || fs_read_only || paths == NULL || count < 0 || count > FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	int fds[FS_FILE_MAX_COUNT];
+	const char *names[FS_FILE_MAX_COUNT];
+	size_t sizes[FS_FILE_MAX_COUNT];
+	size_t num_blks[FS_FILE_MAX_COUNT];
+	size_t total = 0;
+	int num_opened = 0;
+	int num_checked = 0;
+
+	// Check everything before touching the file system, so that nothing is imported unless everything can be.
+	for (int f = 0; f < count; f++) {
+		names[f] = strrchr(paths[f], '/') != NULL ? strrchr(paths[f], '/') + 1 : paths[f];
+		if (names[f][0] == '\0' || is_invalid_file(names[f])) {
+			break;
+		}
+
+		int duplicate = 0;
+		for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+			duplicate |= !strcmp(names[f], root_directory[x].filename);
+		}
+		for (int g = 0; g < f; g++) {
+			duplicate |= !strcmp(names[f], names[g]);
+		}
+		if (duplicate) {
+			break;
+		}
+
+		struct stat st;
+		fds[f] = open(paths[f], O_RDONLY);
+		if (fds[f] < 0) {
+			break;
+		}
+		num_opened++;
+		if (fstat(fds[f], &st) || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > UINT32_MAX) {
+			break;
+		}
+
+		sizes[f] = st.st_size;
+		num_blks[f] = (sizes[f] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		total += num_blks[f];
+		num_checked++;
+	}
+
+	int num_free_entries = 0;
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		num_free_entries += root_directory[x].filename[0] == '\0';
+	}
+	// Blocks freed since the last checkpoint can only be reused after the next one. No operation is under way, so it can be written now.
+	int ready = superblock.log_head == 0 || log_num_freed == 0 || metadata_flush() == 0;
+	size_t num_free_blks = 0;
+	for (uint16_t idx = 1; idx < superblock.amt_data_blks; idx++) {
+		num_free_blks += fat_get(idx) == 0 && !log_is_freed(idx);
+	}
+
+	int ret = -1;
+	if (ready && num_checked == count && count <= num_free_entries && total <= num_free_blks) {
+		ret = import_files(fds, names, sizes, num_blks, count, total) ? -1 : count;
+	}
+
+	// No block is held anymore, so they can be moved around.
+	if (log_need_clean) {
+		log_need_clean = 0;
+		log_replenish();
+	}
+
+	for (int f = 0; f < num_opened; f++) {
+		close(fds[f]);
+	}
+
+	return ret;
+}
+
+// State of fs_extract() shared by the image reading thread and the host writing threads.
+struct extract_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const int *files;
+	const int *fds;
+	const size_t *sizes;
+	struct host_chunk *chunks;
+	size_t num_chunks;
+	// Number of chunks read from the image, and next chunk to write to the host.
+	size_t num_read;
+	size_t next_write;
+	// Chunk @c is read into slot @c % @num_slots, which stays busy until it is written.
+	uint8_t *slots;
+	int *busy;
+	size_t num_slots;
+	int error;
+};
+
+// Whether file @x is extracted through file_read(), its content not lying in its blocks in order: packed and ring files.
+static int extract_by_read(int x)
+{
+	return pack_image != NULL || root_directory[x].ring_num_blks != 0;
+}
+
+// Write chunk @c from @buf to its host file, leaving out what lies past the end of the file.
+static int extract_write_chunk(struct extract_state *state, size_t c, const uint8_t *buf)
+{
+	struct host_chunk *chunk = &state->chunks[c];
+	size_t len = chunk->num_blks * BLOCK_SIZE;
+	if (len > state->sizes[chunk->file] - chunk->offset) {
+		len = state->sizes[chunk->file] - chunk->offset;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = pwrite(state->fds[chunk->file], buf + done, len - done, chunk->offset + done);
+		if (ret <= 0) {
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static void *extract_writer(void *arg)
+{
+	struct extract_state *state = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->error && state->next_write < state->num_chunks && state->next_write >= state->num_read) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->error || state->next_write == state->num_chunks) {
+			pthread_mutex_unlock(&state->lock);
+			return NULL;
+		}
+		size_t c = state->next_write++;
+		pthread_mutex_unlock(&state->lock);
+
+		int ret = extract_write_chunk(state, c, state->slots + (c % state->num_slots) * BLOCK_VEC_MAX * BLOCK_SIZE);
+
+		pthread_mutex_lock(&state->lock);
+		if (ret) {
+			state->error = 1;
+		}
+		state->busy[c % state->num_slots] = 0;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+}
+
+// Read every chunk from the image, in the order of the array. Host files are written by a pool of threads while this one reads.
+static int extract_stream(struct extract_state *state)
+{
+	long num_threads = num_worker_threads(HOST_IO_MAX_THREADS);
+
+	state->num_slots = num_threads * HOST_IO_SLOTS_PER_THREAD;
+	state->slots = malloc(state->num_slots * BLOCK_VEC_MAX * BLOCK_SIZE);
+	state->busy = calloc(state->num_slots, sizeof(int));
+	if (state->slots == NULL || state->busy == NULL) {
+		free(state->slots);
+		free(state->busy);
+		return -1;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+
+	pthread_t tids[num_threads];
+	long num_started = 0;
+	while (num_started < num_threads && !pthread_create(&tids[num_started], NULL, extract_writer, state)) {
+		num_started++;
+	}
+
+	for (size_t c = 0; c < state->num_chunks; c++) {
+		size_t slot = c % state->num_slots;
+		uint8_t *buf = state->slots + slot * BLOCK_VEC_MAX * BLOCK_SIZE;
+
+		pthread_mutex_lock(&state->lock);
+		while (!state->error && state->busy[slot]) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		int error = state->error;
+		pthread_mutex_unlock(&state->lock);
+		if (error) {
+			break;
+		}
+
+		struct host_chunk *chunk = &state->chunks[c];
+		if (extract_by_read(state->files[chunk->file])) {
+			size_t size = state->sizes[chunk->file] - chunk->offset;
+			if (size > chunk->num_blks * BLOCK_SIZE) {
+				size = chunk->num_blks * BLOCK_SIZE;
+			}
+			error = file_read(state->files[chunk->file], chunk->offset, buf, size) != size;
+		} else {
+			void *bufs[BLOCK_VEC_MAX];
+			for (size_t i = 0; i < chunk->num_blks; i++) {
+				bufs[i] = buf + i * BLOCK_SIZE;
+			}
+			error = block_read_vec(chunk->disk_blk, chunk->num_blks, bufs);
+		}
+
+		// Without any writer thread, write each chunk right after reading it.
+		if (!error && num_started == 0) {
+			error = extract_write_chunk(state, c, buf);
+		}
+
+		pthread_mutex_lock(&state->lock);
+		if (error) {
+			state->error = 1;
+		}
+		state->busy[slot] = num_started > 0;
+		state->num_read = c + 1;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	for (long i = 0; i < num_started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	free(state->slots);
+	free(state->busy);
+	return state->error ? -1 : 0;
+}
+
+static int extract_compare_chunks(const void *a, const void *b)
+{
+	const struct host_chunk *chunk_a = a;
+	const struct host_chunk *chunk_b = b;
+
+	return (chunk_a->disk_blk > chunk_b->disk_blk) - (chunk_a->disk_blk < chunk_b->disk_blk);
+}
+
+// Extract files @files of the root directory to host files @fds.
+static int extract_files(const int *files, const int *fds, int count)
+{
+	size_t sizes[FS_FILE_MAX_COUNT];
+	size_t total = 0;
+	for (int f = 0; f < count; f++) {
+		sizes[f] = root_directory[files[f]].size_file;
+		total += (sizes[f] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+
+	struct extract_state state = { .files = files, .fds = fds, .sizes = sizes };
+	state.chunks = malloc((total > 0 ? total : 1) * sizeof(struct host_chunk));
+	if (state.chunks == NULL) {
+		return -1;
+	}
+
+	// Files that do not map to blocks one to one are read by offset, chunks of packed files being numbered in image order.
+	for (int f = 0; f < count; f++) {
+		for (size_t offset = 0; extract_by_read(files[f]) && offset < sizes[f]; offset += PACK_CHUNK_SIZE) {
+			size_t key = pack_image != NULL ? pack_directory[files[f]].idx_first_chunk + offset / PACK_CHUNK_SIZE : superblock.data_blk_start_idx + root_directory[files[f]].idx_first_data_blk;
+			struct host_chunk chunk = { .file = f, .offset = offset, .disk_blk = key, .num_blks = PACK_CHUNK_SIZE / BLOCK_SIZE };
+			state.chunks[state.num_chunks++] = chunk;
+		}
+	}
+
+	// Walk the FAT once to cut every other file into runs of consecutive blocks, then read the runs in disk order.
+	for (int f = 0; f < count; f++) {
+		if (extract_by_read(files[f])) {
+			continue;
+		}
+
+		uint16_t prev = FAT_EOC;
+		uint16_t cur = root_directory[files[f]].idx_first_data_blk;
+		for (size_t offset = 0; offset < sizes[f] && cur != FAT_EOC; offset += BLOCK_SIZE) {
+			if (prev != FAT_EOC && cur == prev + 1 && state.chunks[state.num_chunks - 1].num_blks < BLOCK_VEC_MAX) {
+				state.chunks[state.num_chunks - 1].num_blks++;
+			} else {
+				struct host_chunk chunk = { .file = f, .offset = offset, .disk_blk = superblock.data_blk_start_idx + cur, .num_blks = 1 };
+				state.chunks[state.num_chunks++] = chunk;
+			}
+
+			prev = cur;
+			cur = fat_get(cur);
+		}
+	}
+	qsort(state.chunks, state.num_chunks, sizeof(struct host_chunk), extract_compare_chunks);
+
+	int ret = extract_stream(&state);
+	free(state.chunks);
+	return ret;
+}
+
+int fs_extract(const char *dirname, const char *const filenames[], int count)
+{
+	if (!fs_mounted || dirname == NULL || count < 0 || count > FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	// Without a list of names, every file is extracted.
+	int files[FS_FILE_MAX_COUNT];
+	if (filenames == NULL) {
+		count = 0;
+		for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+			if (root_directory[x].filename[0] != '\0') {
+				files[count++] = x;
+			}
+		}
+	}
+
+	for (int f = 0; filenames != NULL && f < count; f++) {
+		int x;
+		for (x = 0; x < FS_FILE_MAX_COUNT; x++) {
+			if (!is_invalid_file(filenames[f]) && root_directory[x].filename[0] != '\0' && !strcmp(filenames[f], root_directory[x].filename)) {
+				break;
+			}
+		}
+
+		// The file does not exist.
+		if (x == FS_FILE_MAX_COUNT) {
+			return -1;
+		}
+		files[f] = x;
+	}
+
+	// Host files are created with their final size up front, so that runs can be written in any order.
+	int fds[FS_FILE_MAX_COUNT];
+	int num_opened = 0;
+	int num_created = 0;
+	char path[PATH_MAX];
+	for (int f = 0; f < count; f++) {
+		snprintf(path, sizeof(path), "%s/%.16s", dirname, root_directory[files[f]].filename);
+		fds[f] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fds[f] < 0) {
+			break;
+		}
+		num_opened++;
+		if (ftruncate(fds[f], root_directory[files[f]].size_file)) {
+			break;
+		}
+		num_created++;
+	}
+
+	int ret = -1;
+	if (num_created == count) {
+		ret = extract_files(files, fds, count) ? -1 : count;
+	}
+
+	for (int f = 0; f < num_opened; f++) {
+		close(fds[f]);
+	}
+
+	return ret;
+}
+
+// Owner of a block reached by a chain that is not a file's (snapshot or checkpoint metadata).
+#define CHECK_OWNER_INTERNAL UINT8_MAX
+
+// What the mark phase of fs_check() found about one file.
+struct check_file {
+	// Blocks of the chain that can be kept.
+	size_t num_blks;
+	// Set if the chain must end after block @cut_after (FAT_EOC: the file must become empty).
+	int cut;
+	uint16_t cut_after;
+	// Set if the blocks past the cut belong to this file only, and must be freed.
+	int free_tail;
+	// File whose deduplicated chain this one shares and that walks it for both, or -1.
+	int primary;
+};
+
+// State shared by the threads of the mark phase.
+struct check_state {
+	// Who reached each data block first: 0 if nobody, 1 + root directory index for a file, or CHECK_OWNER_INTERNAL.
+	uint8_t owner[UINT16_MAX + 1];
+	struct check_file files[FS_FILE_MAX_COUNT];
+	int num_problems;
+};
+
+// Range of root directory entries walked by one thread of the mark phase.
+struct check_worker {
+	struct check_state *state;
+	int first;
+	int last;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void check_report(struct check_state *state, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[128];
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	// One call per line, so that lines from different threads do not interleave.
+	printf("fsck: %s\n", msg);
+	__atomic_fetch_add(&state->num_problems, 1, __ATOMIC_RELAXED);
+}
+
+// Walk the chain of file @x, claiming its blocks in the shared owner table. A chain stops at the first block it cannot claim.
+static void check_file(struct check_state *state, int x)
+{
+	struct check_file *file = &state->files[x];
+	const char *filename = root_directory[x].filename;
+	size_t need = (root_directory[x].size_file + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// A ring file holds all of its blocks, whatever its size.
+	if (root_directory[x].ring_num_blks != 0) {
+		need = root_directory[x].ring_num_blks;
+		if (root_directory[x].size_file > need * BLOCK_SIZE || root_directory[x].ring_start >= need * BLOCK_SIZE) {
+			check_report(state, "file '%.16s': ring content exceeds its %zu blocks", filename, need);
+		}
+	}
+	uint16_t prev = FAT_EOC;
+	uint16_t keep = FAT_EOC;
+	uint16_t cur = root_directory[x].idx_first_data_blk;
+
+	while (cur != FAT_EOC) {
+		if (cur == 0 || cur >= superblock.amt_data_blks) {
+			check_report(state, "file '%.16s': invalid block index %u in chain", filename, cur);
+			file->cut = 1;
+			file->cut_after = prev;
+			break;
+		}
+
+		uint8_t expected = 0;
+		if (!__atomic_compare_exchange_n(&state->owner[cur], &expected, x + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			if (expected == x + 1) {
+				check_report(state, "file '%.16s': chain loops back to block %u", filename, cur);
+			} else {
+				check_report(state, "file '%.16s': block %u is cross-linked", filename, cur);
+			}
+			file->cut = 1;
+			file->cut_after = prev;
+			break;
+		}
+
+		file->num_blks++;
+		if (file->num_blks == need) {
+			keep = cur;
+		}
+
+		uint16_t next_location = fat_get(cur);
+		if (next_location == 0 || next_location == FAT_SNAP) {
+			check_report(state, "file '%.16s': chain runs into unallocated block %u", filename, cur);
+			file->cut = 1;
+			file->cut_after = cur;
+			break;
+		}
+
+		prev = cur;
+		cur = next_location;
+	}
+
+	// The chain must hold exactly as many blocks as the size requires. Blocks past the end of a chain that is merely too long are this file's alone.
+	if (file->num_blks < need) {
+		check_report(state, "file '%.16s': size exceeds chain of %zu blocks", filename, file->num_blks);
+	} else if (file->num_blks > need && !file->cut) {
+		check_report(state, "file '%.16s': chain of %zu blocks exceeds size", filename, file->num_blks);
+		file->num_blks = need;
+		file->cut = 1;
+		file->cut_after = keep;
+		file->free_tail = 1;
+	}
+}
+
+static void *check_worker(void *arg)
+{
+	struct check_worker *w = arg;
+
+	for (int x = w->first; x < w->last; x++) {
+		if (root_directory[x].filename[0] != '\0' && w->state->files[x].primary < 0) {
+			check_file(w->state, x);
+		}
+	}
+
+	return NULL;
+}
+
+// Claim the blocks of a snapshot or checkpoint metadata chain.
+static void check_internal_chain(struct check_state *state, const char *kind, const char *name, uint16_t cur)
+{
+	while (cur != FAT_EOC) {
+		if (cur == 0 || cur >= superblock.amt_data_blks || state->owner[cur] != 0) {
+			check_report(state, "%s '%.16s': metadata chain is damaged at block %u", kind, name, cur);
+			return;
+		}
+		state->owner[cur] = CHECK_OWNER_INTERNAL;
+		cur = fat_get(cur);
+	}
+}
+
+// Make the FAT and root directory agree with what the mark phase kept. The file system must be mounted for writing.
+static void check_repair(struct check_state *state)
+{
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		struct check_file *file = &state->files[x];
+		if (root_directory[x].filename[0] == '\0') {
+			continue;
+		}
+		root_directory[x].filename[FS_FILENAME_LEN - 1] = '\0';
+
+		if (file->cut) {
+			uint16_t tail;
+			if (file->cut_after == FAT_EOC) {
+				tail = root_directory[x].idx_first_data_blk;
+				root_directory[x].idx_first_data_blk = FAT_EOC;
+			} else {
+				tail = fat_get(file->cut_after);
+				fat_set(file->cut_after, FAT_EOC);
+			}
+
+			while (file->free_tail && tail != FAT_EOC) {
+				uint16_t next_location = fat_get(tail);
+				fat_set(tail, 0);
+				state->owner[tail] = 0;
+				tail = next_location;
+			}
+		}
+
+		if (root_directory[x].size_file > file->num_blks * BLOCK_SIZE) {
+			root_directory[x].size_file = file->num_blks * BLOCK_SIZE;
+		}
+
+		// A ring file keeps what is left of its blocks.
+		if (root_directory[x].ring_num_blks != 0) {
+			root_directory[x].ring_num_blks = file->num_blks;
+			if (root_directory[x].ring_start >= file->num_blks * BLOCK_SIZE) {
+				root_directory[x].ring_start = 0;
+			}
+		}
+	}
+
+	if (superblock.amt_data_blks > 0) {
+		fat_set(0, FAT_EOC);
+	}
+
+	// Reference counts follow the files sharing each chain.
+	for (int i = 0; superblock.idx_dedup_blk != 0 && (dedup_loaded || !dedup_load()) && i < FS_FILE_MAX_COUNT; i++) {
+		struct dedup_entry *entry = &dedup_index.entries[i];
+		if (entry->refcount > 0 && entry->refcount != dedup_count_refs(entry->idx_first_data_blk)) {
+			entry->refcount = dedup_count_refs(entry->idx_first_data_blk);
+			dedup_dirty = 1;
+		}
+	}
+}
+
+// Whether data block @idx is allocated although nothing reaches it. A block set aside for snapshots is, once none of them still shares it.
+static int check_lost(struct check_state *state, uint16_t idx)
+{
+	uint16_t entry = fat_get(idx);
+
+	return state->owner[idx] == 0 && entry != 0 && (entry != FAT_SNAP || !snap_is_frozen(idx));
+}
+
+int fs_check(const char *diskname, int repair)
+{
+	if (fs_mounted || fs_mount_ro(diskname)) {
+		return -1;
+	}
+
+	// Packed images are checked as they are mounted.
+	if (pack_image != NULL) {
+		fs_umount();
+		return 0;
+	}
+
+	// The layout must be the one fs_format() creates, or nothing else can be trusted.
+	if (superblock.root_dir_blk_idx != 1 + superblock.num_blks_fat || superblock.data_blk_start_idx != superblock.root_dir_blk_idx + 1
+	    || superblock.data_blk_start_idx + superblock.amt_data_blks != superblock.tot_amt_blks
+	    || superblock.num_blks_fat * NUM_ENTRIES_FAT_BLK < superblock.amt_data_blks) {
+		printf("fsck: inconsistent superblock\n");
+		fs_umount();
+		return -1;
+	}
+
+	struct check_state *state = calloc(1, sizeof(struct check_state));
+	if (state == NULL) {
+		fs_umount();
+		return -1;
+	}
+
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		if (root_directory[x].filename[0] != '\0' && memchr(root_directory[x].filename, '\0', FS_FILENAME_LEN) == NULL) {
+			check_report(state, "file '%.16s': name is not terminated", root_directory[x].filename);
+		}
+	}
+	if (superblock.amt_data_blks > 0 && fat_get(0) != FAT_EOC) {
+		check_report(state, "FAT entry 0 is not end of chain");
+	}
+
+	// Metadata chains are claimed first, so that files running into them are reported as cross-linked.
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (superblock.snapshots[i].name[0] != '\0') {
+			check_internal_chain(state, "snapshot", superblock.snapshots[i].name, superblock.snapshots[i].idx_first_meta_blk);
+		}
+	}
+	for (int i = 0; i < FS_CHECKPOINT_MAX_COUNT; i++) {
+		if (superblock.checkpoints[i].name[0] != '\0') {
+			check_internal_chain(state, "checkpoint", superblock.checkpoints[i].name, superblock.checkpoints[i].idx_first_map_blk);
+		}
+	}
+
+	// Files sharing a deduplicated chain are walked once, through the first of them. The index must count them all.
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		state->files[x].primary = root_directory[x].filename[0] != '\0' ? dedup_primary(x) : -1;
+	}
+	if (superblock.idx_dedup_blk != 0) {
+		check_internal_chain(state, "dedup", "index", superblock.idx_dedup_blk);
+		for (int i = 0; (dedup_loaded || !dedup_load()) && i < FS_FILE_MAX_COUNT; i++) {
+			struct dedup_entry *entry = &dedup_index.entries[i];
+			if (entry->refcount > 0 && entry->refcount != dedup_count_refs(entry->idx_first_data_blk)) {
+				check_report(state, "dedup index: chain at block %u has %d references, not %u", entry->idx_first_data_blk, dedup_count_refs(entry->idx_first_data_blk), entry->refcount);
+			}
+		}
+	}
+
+	// Mark phase: threads split the root directory and claim blocks in the shared owner table. The FAT is read in place from the read-only mapping, so no lock is needed.
+	long num_threads = num_worker_threads(FS_FILE_MAX_COUNT);
+
+	pthread_t tids[num_threads];
+	struct check_worker workers[num_threads];
+	int started[num_threads];
+	for (long i = 0; i < num_threads; i++) {
+		workers[i].state = state;
+		workers[i].first = FS_FILE_MAX_COUNT * i / num_threads;
+		workers[i].last = FS_FILE_MAX_COUNT * (i + 1) / num_threads;
+		started[i] = pthread_create(&tids[i], NULL, check_worker, &workers[i]) == 0;
+		if (!started[i]) {
+			check_worker(&workers[i]);
+		}
+	}
+	for (long i = 0; i < num_threads; i++) {
+		if (started[i]) {
+			pthread_join(tids[i], NULL);
+		}
+	}
+
+	for (int x = 0; x < FS_FILE_MAX_COUNT; x++) {
+		int primary = state->files[x].primary;
+		if (primary < 0) {
+			continue;
+		}
+
+		state->files[x].num_blks = state->files[primary].num_blks;
+		if (root_directory[x].size_file > state->files[x].num_blks * BLOCK_SIZE) {
+			check_report(state, "file '%.16s': size exceeds chain of %zu blocks", root_directory[x].filename, state->files[x].num_blks);
+		}
+	}
+
+	// Sweep phase: any allocated block that nothing reaches is lost. Blocks only held by a snapshot are not, as long as the FAT saved by one of them uses it.
+	for (uint16_t i = 1; i < superblock.amt_data_blks; i++) {
+		if (check_lost(state, i)) {
+			check_report(state, "block %u is allocated but not used", i);
+		}
+	}
+
+	int num_problems = state->num_problems;
+	if (repair && num_problems > 0) {
+		fs_umount();
+		if (fs_mount(diskname)) {
+			free(state);
+			return -1;
+		}
+
+		check_repair(state);
+		for (uint16_t i = 1; i < superblock.amt_data_blks; i++) {
+			if (check_lost(state, i)) {
+				fat_set(i, 0);
+			}
+		}
+		if (metadata_flush()) {
+			num_problems = -1;
+		}
 	}
-	
-	memcpy(buf, &file_blocks_array[FD[i].file_offset], actual_count);
 
-	FD[i].file_offset += actual_count;
-	return actual_count;
+	free(state);
+	fs_umount();
+	return num_problems;
 }
@@ -12,6 +12,62 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX_COUNT 8
+
+/** Maximum number of checkpoints of a file system */
+#define FS_CHECKPOINT_MAX_COUNT 4
+
+/** Maximum number of data blocks of a file system */
+#define FS_DATA_BLK_MAX_COUNT 65501
+
+/** Access pattern advice for fs_fadvise() */
+#define FS_FADV_NORMAL 0
+#define FS_FADV_SEQUENTIAL 1
+#define FS_FADV_RANDOM 2
+#define FS_FADV_WILLNEED 3
+#define FS_FADV_DONTNEED 4
+#define FS_FADV_NOREUSE 5
+
+/**
+ * struct fs_format_options - Optional settings of fs_format()
+ * @fat_reserve_blks: Number of FAT blocks to reserve on top of those needed by
+ * the data blocks, so that the volume can later grow in place
+ * @preallocate: Allocate the disk space of the virtual disk file up front
+ * instead of creating a sparse file
+ * @log_structured: Write data blocks sequentially, at the head of a log,
+ * rather than in place (see fs_clean())
+ *
+ * The block size (%BLOCK_SIZE) and the size of the root directory
+ * (%FS_FILE_MAX_COUNT entries, one block) are fixed by the on-disk format.
+ */
+struct fs_format_options {
+	unsigned int fat_reserve_blks;
+	int preallocate;
+	int log_structured;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks
+ * @options: Optional settings, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and lay out
+ * an empty file system with @data_blk_count data blocks on it: a superblock,
+ * as many FAT blocks as the data blocks need (plus any reserved with
+ * @options), the root directory, and the data blocks. Only the superblock and
+ * the first FAT block are written; the rest of the virtual disk is left as a
+ * hole that reads as zeroes.
+ *
+ * Return: -1 if a FS is currently mounted, or if @diskname is invalid, or if
+ * @data_blk_count is 0 or larger than %FS_DATA_BLK_MAX_COUNT, or if the
+ * resulting layout does not fit the on-disk format, or if the virtual disk file
+ * cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count,
+	      const struct fs_format_options *options);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,14 +81,127 @@
  */
 int fs_mount(const char *diskname);
 
+/** Eviction policies of the block cache, for struct fs_mount_options */
+#define FS_CACHE_LRU 0
+#define FS_CACHE_2Q 1
+
+/**
+ * struct fs_mount_options - Optional settings of fs_mount_with()
+ * @cache_policy: Eviction policy of the cache of metadata blocks, %FS_CACHE_LRU
+ * or %FS_CACHE_2Q. 2Q keeps blocks that are only used in a single burst, such as
+ * the FAT blocks walked through by a large sequential read, from evicting the
+ * blocks that are used over and over.
+ * @cache_slots: Number of blocks the cache keeps resident, or 0 for the default
+ * @pin_metadata: Read the superblock, the whole FAT and the root directory at
+ * mount time, and keep them resident in a tier of the cache of their own, on
+ * top of the @cache_slots others. Lookups in the FAT then never wait for the
+ * disk, whatever else goes through the cache.
+ * @ram_disk: Read the whole virtual disk file into memory, and work from there.
+ * Changes are only written back to the virtual disk file by fs_umount().
+ * @regular_pages: Back the cache and the RAM disk with regular pages only. By
+ * default, they are backed by huge pages when they are large enough and the
+ * host has them, which spares random accesses most TLB misses.
+ */
+struct fs_mount_options {
+	int cache_policy;
+	unsigned int cache_slots;
+	int pin_metadata;
+	int ram_disk;
+	int regular_pages;
+};
+
+/**
+ * fs_mount_with - Mount a file system with non-default settings
+ * @diskname: Name of the virtual disk file
+ * @options: Settings, or NULL for the defaults (same as fs_mount())
+ *
+ * Same as fs_mount(), with the settings given by @options.
+ *
+ * Return: -1 if @options are invalid, or if fs_mount() would fail. 0
+ * otherwise.
+ */
+int fs_mount_with(const char *diskname, const struct fs_mount_options *options);
+
+/**
+ * struct fs_cache_stats - Counters of the cache of metadata blocks
+ * @policy: Eviction policy in use, %FS_CACHE_LRU or %FS_CACHE_2Q
+ * @hits: Number of lookups that found the block resident
+ * @misses: Number of lookups that had to read the block from disk
+ * @evictions: Number of blocks evicted to make room for another one
+ *
+ * File data never goes through this cache, only the FAT, the root directory
+ * and the superblock do.
+ */
+struct fs_cache_stats {
+	int policy;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/**
+ * fs_get_cache_stats - Get the counters of the block cache
+ * @stats: Counters to fill in
+ *
+ * Fill @stats with the counters of the block cache, accumulated since the file
+ * system was mounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is mounted read-only, in
+ * which case metadata is used in place and there is no cache. 0 otherwise.
+ */
+int fs_get_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_mount_overlay - Mount a file system stored in a base and a delta image
+ * @basename: Name of the base virtual disk file
+ * @deltaname: Name of the delta image file
+ *
+ * Mount the file system contained in virtual disk file @basename for reading
+ * and writing, without ever modifying @basename: every block written goes to
+ * the delta image @deltaname instead, and is read back from there. A missing
+ * or empty @deltaname is created, so many short-lived instances can be started
+ * from the same base image by giving each its own delta image.
+ *
+ * Return: -1 if either file cannot be opened, if @deltaname is not a delta
+ * image of @basename, or if no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_overlay(const char *basename, const char *deltaname);
+
+/**
+ * fs_mount_ro - Mount a file system read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), but the virtual disk file is opened without write access
+ * and every call that would modify the file system (fs_create(), fs_delete(),
+ * fs_write()) fails. Since metadata cannot change, no allocator state is set
+ * up, and fs_read() and fs_pread() do not modify any shared state: several
+ * threads can read from the file system in parallel without synchronization,
+ * as long as fs_open() and fs_close() are not called concurrently.
+ *
+ * The image is mapped in memory and used in place rather than copied, so
+ * mounting reads nothing up front, and processes mounting the same image
+ * share a single copy of its metadata and data in the page cache.
+ *
+ * Packed images (see fs_pack()) can only be mounted this way. Their content is
+ * decompressed as it is read.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_ro(const char *diskname);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
  * disk file.
  *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * Return: -1 if no FS is currently mounted, or if the metadata cannot be
+ * written to the virtual disk, or if the virtual disk cannot be closed, or if
+ * there are still open file descriptors. 0 otherwise. A file system whose
+ * metadata, or whose changes when mounted with the ram_disk option of
+ * fs_mount_with(), cannot be written back stays mounted, so that fs_umount()
+ * can be retried.
  */
 int fs_umount(void);
 
@@ -54,12 +223,32 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @filename is invalid, or if a file named @filename already exists, or
+ * if string @filename is too long, or if the root directory already contains
+ * %FS_FILE_MAX_COUNT files, or if the metadata cannot be written to disk. 0
+ * otherwise.
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_create_ring - Create a new ring file
+ * @filename: File name
+ * @capacity: Number of bytes the file keeps, rounded up to whole blocks
+ *
+ * Same as fs_create(), but the file is a ring file, meant for rolling logs.
+ * All the blocks it will ever use are allocated up front. Writing to a ring
+ * file always appends to it, whatever the file offset, and once it holds
+ * @capacity bytes every write overwrites its oldest bytes. Its offset 0 is its
+ * oldest byte. Appending neither allocates blocks nor changes the FAT, so the
+ * only metadata written is the file's root directory entry, which records its
+ * size and where its oldest byte lies.
+ *
+ * Return: -1 if fs_create() fails, or if @capacity is 0 or too large, or if
+ * there is not enough room on the disk. 0 otherwise.
+ */
+int fs_create_ring(const char *filename, size_t capacity);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
@@ -67,9 +256,10 @@ int fs_create(const char *filename);
  * Delete the file named @filename from the root directory of the mounted file
  * system.
  *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @filename is invalid, if there is no file named @filename to delete, or
+ * if file @filename is currently open, or if the metadata cannot be written to
+ * disk. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -82,6 +272,43 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_block_owner - Find which file a disk block belongs to
+ * @block: Index of a block of the virtual disk
+ * @filename: Buffer of at least %FS_FILENAME_LEN bytes
+ *
+ * Look for the file of the mounted file system whose content is stored in
+ * block @block of the virtual disk, and copy its name into @filename.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is NULL, or if
+ * @block is out of bounds. 0 if @block belongs to a file, whose name was copied
+ * into @filename. 1 if @block holds file system metadata (superblock, FAT or
+ * root directory). 2 if @block does not belong to any file.
+ */
+int fs_block_owner(size_t block, char *filename);
+
+/** Owners of blocks that do not belong to any file, for fs_block_owners() */
+#define FS_OWNER_METADATA -1
+#define FS_OWNER_NONE -2
+
+/**
+ * fs_block_owners - Find which file every disk block belongs to
+ * @owners: Array of @num_blks entries
+ * @num_blks: Number of blocks of the virtual disk to look up
+ * @names: Array of %FS_FILE_MAX_COUNT names
+ *
+ * Same as fs_block_owner(), for blocks 0 to @num_blks - 1 at once: the chain
+ * of each file is only walked once. @owners[b] is set to the index in @names
+ * of the file whose content is stored in block b, to %FS_OWNER_METADATA if it
+ * holds file system metadata, or to %FS_OWNER_NONE if it does not belong to
+ * any file. @names receives the name of every file of the root directory, at
+ * the index of its entry, and an empty string for unused entries.
+ *
+ * Return: -1 if no FS is currently mounted, or if @owners or @names is NULL.
+ * 0 otherwise.
+ */
+int fs_block_owners(int *owners, size_t num_blks, char names[][FS_FILENAME_LEN]);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -101,6 +328,23 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_append - Open a file for appending
+ * @filename: File name
+ *
+ * Same as fs_open(), but every write through the returned file descriptor goes
+ * to the end of the file, whatever its file offset, and leaves the offset at the
+ * new end of the file. The descriptor remembers the last block it wrote, so
+ * appending does not search the file's blocks. The file's new size is only
+ * written to disk when the file descriptor is closed with fs_close(): until
+ * then, appended data may not survive a crash. The file system cannot be
+ * unmounted while the descriptor is open.
+ *
+ * Return: -1 if fs_open() fails, or if the FS is mounted read-only. Otherwise,
+ * return the file descriptor.
+ */
+int fs_open_append(const char *filename);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -108,7 +352,8 @@ int fs_open(const char *filename);
  * Close file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the metadata cannot be
+ * written to disk (@fd is closed all the same). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -155,8 +400,12 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * Ring files (see fs_create_ring()) and files opened with fs_open_append() are
+ * always appended to.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if file descriptor @fd is invalid (out of bounds or not currently open),
+ * or if @buf is NULL, or if the metadata cannot be written to disk. Otherwise
  * return the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
@@ -176,10 +425,337 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * Large reads are split into runs of consecutive blocks, which are read
+ * concurrently by a pool of threads into their part of @buf, so that the disk
+ * gets several requests at a time.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from offset @offset instead of the file offset
+ * of the file descriptor, which is left unchanged. On a file system mounted
+ * with fs_mount_ro(), several threads can share the same file descriptor.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_fadvise - Announce how a file is going to be accessed
+ * @fd: File descriptor
+ * @offset: File offset of the range the advice is about
+ * @len: Length of the range, or 0 for the rest of the file
+ * @advice: One of the %FS_FADV_* values
+ *
+ * Give a hint about the future use of the file referenced by file descriptor
+ * @fd, so that reading it fills the host's cache of the virtual disk file with
+ * what is about to be needed, and only with that. File data is read straight
+ * from the virtual disk file, so this is the cache that matters.
+ *
+ * %FS_FADV_WILLNEED starts reading the range in the background, and
+ * %FS_FADV_DONTNEED drops it from the cache. The other values tell how @fd is
+ * going to be read from now on. With %FS_FADV_SEQUENTIAL, fs_read() asks for
+ * the blocks ahead of the file offset in advance, in growing windows. With
+ * %FS_FADV_NOREUSE, fs_read() and fs_pread() drop the blocks they went past,
+ * so that a single scan of a large file does not evict what other readers
+ * keep using. %FS_FADV_RANDOM turns readahead off, and %FS_FADV_NORMAL brings
+ * the default back. On a file system mounted with fs_mount_ro(), these three
+ * also set the host's readahead policy for the range.
+ *
+ * The content of the file is never affected.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @advice is invalid.
+ * 0 otherwise.
+ */
+int fs_fadvise(int fd, size_t offset, size_t len, int advice);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Capture the current state of the mounted file system under name @name.
+ * Only the FAT and the root directory are copied, into free data blocks, so
+ * the cost does not depend on the amount of file data. Data blocks are shared
+ * between the live file system and its snapshots: a shared block is copied
+ * the first time the live file system modifies it, and a deleted file's blocks
+ * are only reclaimed once no snapshot uses them anymore. String @name follows
+ * the same rules as file names.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @name is invalid, or if a snapshot named @name already exists, or if
+ * there are already %FS_SNAPSHOT_MAX_COUNT snapshots, or if there is not
+ * enough free space to hold the copy of the metadata, or if the metadata cannot
+ * be written to disk. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete the snapshot named @name of the mounted file system, and free the
+ * data blocks that only this snapshot was using.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @name is invalid, or if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_mount_snapshot - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @name: Snapshot name
+ *
+ * Mount the snapshot named @name of the file system contained in virtual disk
+ * file @diskname. The snapshot is mounted read-only, with the same properties
+ * as fs_mount_ro(), and shows the files as they were when fs_snapshot() was
+ * called.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, or if there is no snapshot named @name. 0
+ * otherwise.
+ */
+int fs_mount_snapshot(const char *diskname, const char *name);
+
+/**
+ * fs_checkpoint - Start tracking changes from now on
+ * @name: Checkpoint name
+ *
+ * Create a checkpoint named @name on the mounted file system, or move it to the
+ * present if it already exists. From then on, every modified block of the
+ * disk is recorded in a bitmap stored on the file system, so that only the
+ * blocks changed since the checkpoint need to be copied by an incremental
+ * backup (see fs_export_changes()). String @name follows the same rules as
+ * file names.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @name is invalid, or if there are already %FS_CHECKPOINT_MAX_COUNT
+ * checkpoints, or if there is not enough free space to hold the bitmap. 0
+ * otherwise.
+ */
+int fs_checkpoint(const char *name);
+
+/**
+ * fs_checkpoint_delete - Stop tracking changes for a checkpoint
+ * @name: Checkpoint name
+ *
+ * Delete the checkpoint named @name of the mounted file system.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if @name is invalid, or if there is no checkpoint named @name. 0
+ * otherwise.
+ */
+int fs_checkpoint_delete(const char *name);
+
+/**
+ * fs_export_changes - Save the blocks changed since a checkpoint
+ * @name: Checkpoint name
+ * @filename: Name of the host file to create
+ *
+ * Write every block of the mounted file system's disk that changed since
+ * checkpoint @name into host file @filename, along with its index. Blocks
+ * holding changed-block bitmaps are not exported. Applying the result to a copy
+ * of the disk taken at the checkpoint with fs_apply_changes() brings it up to
+ * date.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if there is no checkpoint named @name, or if @filename cannot be written.
+ * Otherwise return the number of exported blocks.
+ */
+int fs_export_changes(const char *name, const char *filename);
+
+/**
+ * fs_apply_changes - Apply changed blocks to a virtual disk
+ * @diskname: Name of the virtual disk file
+ * @filename: Name of the host file created by fs_export_changes()
+ *
+ * Overwrite the blocks of virtual disk file @diskname with the blocks saved in
+ * host file @filename. No file system must be mounted.
+ *
+ * Return: -1 if a FS is currently mounted, or if either file cannot be opened,
+ * or if @filename was not created by fs_export_changes() for a disk of the same
+ * size. Otherwise return the number of applied blocks.
+ */
+int fs_apply_changes(const char *diskname, const char *filename);
+
+/**
+ * fs_clean - Reclaim segments of a log-structured file system
+ *
+ * On a log-structured file system, data blocks are written in segments of
+ * consecutive blocks, each filled from first to last at the head of the log,
+ * and writing to a block of a file moves it to the head of the log instead of
+ * overwriting it. The FAT, the root directory and the superblock, which holds
+ * the head of the log, are written together as a log checkpoint (unrelated to
+ * fs_checkpoint()) once a segment's worth of blocks was appended, when a
+ * written file is closed, and on unmount. Blocks freed in between are only
+ * reused after the next log checkpoint, so that the file system on disk is
+ * always the one of the last log checkpoint.
+ *
+ * When the log runs short of clean segments, the segment with the fewest live
+ * blocks according to the FAT is cleaned after the write that used one up:
+ * its live blocks are moved to the head of the log. fs_clean() does the same
+ * for every segment that is at most half full, ahead of time, e.g. while the
+ * file system is idle. Segments holding blocks shared with a snapshot, or
+ * blocks of snapshots, checkpoints or the dedup index, are never cleaned.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only
+ * or is not log-structured, or if a block cannot be moved. Otherwise return
+ * the number of cleaned segments.
+ */
+int fs_clean(void);
+
+/**
+ * fs_dedup - Store identical files once
+ *
+ * Turn on deduplication for the mounted file system, which then stays on.
+ * Files with the same content share the same chain of data blocks, recorded
+ * along with a hash of the content and a reference count in an index stored
+ * on the file system. Files are hashed when closed after being written to, and
+ * when added with fs_import(). Writing to a file that shares its blocks first
+ * gives it a copy of its own. Files already present when deduplication is
+ * turned on are deduplicated by this call.
+ *
+ * The FAT links each data block to a single next block, so a chain can only be
+ * shared whole: identical blocks are only stored once when they make up
+ * identical files.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if there is no free data block for the index. Otherwise return the number
+ * of data blocks freed.
+ */
+int fs_dedup(void);
+
+/**
+ * fs_grow - Grow the mounted file system
+ * @new_block_count: New total number of blocks of the virtual disk
+ *
+ * Extend the virtual disk of the mounted file system to @new_block_count
+ * blocks, and make the new blocks available as data blocks. The FAT blocks
+ * reserved by fs_format() are used first, in which case only the superblock
+ * and FAT are updated. Beyond them, the FAT needs more blocks: the root
+ * directory and every allocated data block are then moved further on the disk
+ * to make room, and the operation must not be interrupted.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only
+ * or through an overlay, or if @new_block_count is not larger than the
+ * current block count or exceeds the limits of the format, or if the FAT must
+ * grow while snapshots exist, or if there is not enough room for extending the
+ * bitmaps of checkpoints. 0 otherwise.
+ */
+int fs_grow(size_t new_block_count);
+
+/**
+ * fs_compact - Compact a file system and shrink its virtual disk
+ * @diskname: Name of the virtual disk file
+ *
+ * Rewrite the file system contained in virtual disk file @diskname so that the
+ * blocks of every file are moved to the front of the data region, one file
+ * after the other, and truncate the virtual disk to just what they need. The
+ * FAT shrinks accordingly. The compacted image is written to a new host file,
+ * which replaces virtual disk file @diskname once complete. No file system
+ * must be mounted.
+ *
+ * Return: -1 if a FS is currently mounted, or if virtual disk file @diskname
+ * cannot be opened or replaced, or if it holds snapshots or checkpoints, or if
+ * a FAT chain is damaged (see fs_check()). Otherwise return the number of
+ * blocks the virtual disk shrank by.
+ */
+int fs_compact(const char *diskname);
+
+/**
+ * fs_pack - Convert a file system to a packed read-only image
+ * @diskname: Name of the virtual disk file
+ * @packname: Name of the packed image file to create
+ *
+ * Write the files of the file system contained in virtual disk file @diskname
+ * to a new packed image file @packname, meant to be published and mounted
+ * with fs_mount_ro(). Instead of a FAT, a packed image describes each file by
+ * the range of chunks holding its content, in a directory sorted by name.
+ * Every chunk of a file is compressed on its own, so that reading part of a
+ * file only decompresses the chunks it covers. Files sharing deduplicated
+ * content share their chunks. Snapshots and checkpoints are left out. No file
+ * system must be mounted.
+ *
+ * Return: -1 if a FS is currently mounted, or if virtual disk file @diskname
+ * cannot be opened or is already packed, or if file @packname cannot be
+ * written. Otherwise return the number of blocks of the packed image.
+ */
+int fs_pack(const char *diskname, const char *packname);
+
+/**
+ * fs_import - Add several host files at once
+ * @paths: Names of the host files
+ * @count: Number of host files
+ *
+ * Create a file in the mounted file system for each of the @count host files
+ * of array @paths, named after the last component of its path, and copy its
+ * content. The layout of all the files is planned up front: they are
+ * allocated back to back in a single run of free blocks if possible, else in a
+ * run of free blocks each if possible. Host files are read by several threads
+ * while their data is written to the disk in layout order, and the metadata is
+ * only written once, at the end. Either all files are imported or none is.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FS is mounted read-only,
+ * or if a host file cannot be read, or if a file name is invalid or already
+ * taken, or if there is not enough room in the root directory or on the disk.
+ * Otherwise return the number of imported files.
+ */
+int fs_import(const char *const paths[], int count);
+
+/**
+ * fs_extract - Copy several files to the host at once
+ * @dirname: Name of the host directory
+ * @filenames: Names of the files, or NULL for every file
+ * @count: Number of files in @filenames
+ *
+ * Copy the content of the @count files of array @filenames, or of every file
+ * if @filenames is NULL, from the mounted file system into host files of the
+ * same names within host directory @dirname. Existing host files are
+ * overwritten. The FAT is walked once to plan every read, blocks are read from
+ * the disk in increasing order, and host files are written by several threads
+ * in the meantime.
+ *
+ * Return: -1 if no FS is currently mounted, or if a file does not exist, or if
+ * a host file cannot be written. Otherwise return the number of extracted
+ * files.
+ */
+int fs_extract(const char *dirname, const char *const filenames[], int count);
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file
+ * @repair: Whether to fix the problems found
+ *
+ * Check the file system contained in virtual disk file @diskname: the layout
+ * described by the superblock, every file's FAT chain, and the chains holding
+ * snapshots and checkpoints. Each problem is reported on the standard output:
+ * invalid block indices, chains looping back on themselves, blocks shared by
+ * several chains (cross-linked), chains running into free blocks, file sizes
+ * that do not match their chain length, and allocated blocks that nothing
+ * uses (lost). Chains are walked by several threads in parallel.
+ *
+ * If @repair is set, chains are cut before the first faulty block, sizes are
+ * reduced to what the chains can hold, chains longer than needed are trimmed
+ * and lost blocks are freed. The data of a cross-linked block is left to the
+ * first chain found to reach it. No file system must be mounted.
+ *
+ * Return: -1 if a FS is currently mounted, or if virtual disk file @diskname
+ * cannot be opened, or if its superblock is inconsistent, or if the repairs
+ * cannot be written to disk. Otherwise return the number of problems found.
+ */
+int fs_check(const char *diskname, int repair);
+
 #endif /* _FS_H */